@@ -0,0 +1,46 @@
+#include "alloc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef  __linux__
+#include <sys/mman.h>
+#endif
+
+const size_t hugePage = 2 << 20;
+const size_t cacheLine = 64;
+
+static size_t roundUp(size_t bytes, size_t to) {
+    return (bytes + to - 1) / to * to;
+}
+
+void *allocHuge(size_t bytes) {
+#ifdef  __linux__
+    size_t size = roundUp(bytes, hugePage);
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) return ptr;
+
+    // No reserved huge pages, so over-map to get a 2 MB aligned range and
+    // ask for transparent huge pages on it
+    char *raw = (char *) mmap(NULL, size + hugePage, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *aligned = (char *) roundUp((uintptr_t) raw, hugePage);
+    if (aligned > raw) munmap(raw, aligned - raw);
+    munmap(aligned + size, raw + hugePage - aligned);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+#else
+    void *ptr;
+    if (posix_memalign(&ptr, cacheLine, roundUp(bytes, cacheLine)) != 0) return NULL;
+    return ptr;
+#endif
+}
+
+void freeHuge(void *ptr, size_t bytes) {
+    if (ptr == NULL) return;
+#ifdef  __linux__
+    munmap(ptr, roundUp(bytes, hugePage));
+#else
+    free(ptr);
+#endif
+}
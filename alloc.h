@@ -0,0 +1,13 @@
+#ifndef POPCORN_ALLOC_H
+#define POPCORN_ALLOC_H
+
+#include <stddef.h>
+
+// Large buffers are backed by 2 MB pages when the system allows it: explicit
+// hugetlbfs pages first, then transparent huge pages. The result is always at
+// least 64-byte aligned. Pages are not touched here, so whichever thread
+// writes a page first decides its NUMA node.
+void *allocHuge(size_t bytes);
+void freeHuge(void *ptr, size_t bytes);
+
+#endif
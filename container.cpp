@@ -0,0 +1,466 @@
+#include "container.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+extern "C" {
+    #include "rgbe.h"
+};
+
+static const char containerMagic[8] = "POPSEQ2", hdrOnlyMagic[8] = "POPSEQ1";
+static const size_t pageBytes = 4096, payloadAlign = 64;
+
+static size_t roundUp(size_t bytes, size_t to) {
+    return (bytes + to - 1) / to * to;
+}
+
+// Largest .hdr a frame can encode to: the text header, then per scanline a
+// 4 byte marker and each channel as literal dumps of at most 128 bytes
+static size_t worstFrameBytes(int width, int height) {
+    size_t line = 4 + 4 * (width + (width + 127) / 128);
+    return roundUp(256 + line * height, payloadAlign);
+}
+
+static int tilesAcross(int pixels) {
+    return (pixels + tileSize - 1) / tileSize;
+}
+
+// Largest tiled frame: the tile table, then per tile and channel a mode
+// byte and a literal stream, which the encoder never exceeds
+static size_t worstTiledBytes(int width, int height) {
+    size_t tiles = (size_t) tilesAcross(width) * tilesAcross(height);
+    size_t n = tileSize * tileSize;
+    return roundUp(tiles * sizeof(uint32_t) + tiles * 4 * (1 + n + (n + 127) / 128), payloadAlign);
+}
+
+struct Tile {
+    int x0, y0, w, h;
+};
+
+static Tile tileAt(const ContainerHeader *h, int t) {
+    int across = tilesAcross(h->width);
+    Tile tile;
+    tile.x0 = t % across * tileSize;
+    tile.y0 = t / across * tileSize;
+    tile.w = std::min(tileSize, (int) h->width - tile.x0);
+    tile.h = std::min(tileSize, (int) h->height - tile.y0);
+    return tile;
+}
+
+static void gatherTile(const unsigned char *plane, int width, const Tile &t, unsigned char *out) {
+    for (int y = 0; y < t.h; y++) memcpy(out + y * t.w, plane + (size_t) (t.y0 + y) * width + t.x0, t.w);
+}
+
+static void scatterTile(const unsigned char *in, int width, const Tile &t, unsigned char *plane) {
+    for (int y = 0; y < t.h; y++) memcpy(plane + (size_t) (t.y0 + y) * width + t.x0, in + y * t.w, t.w);
+}
+
+// RLE as in .hdr scanlines: a count byte over 128 is a run of count - 128
+// copies of the next byte, any other count is followed by that many
+// literal bytes. Returns the coded size, at most n + n/128 + 1.
+static size_t rleEncode(const unsigned char *src, int n, unsigned char *out) {
+    unsigned char *p = out;
+    int i = 0, literal = 0;
+    while (i <= n) {
+        int run = 1;
+        while (i < n && i + run < n && run < 127 && src[i + run] == src[i]) run++;
+        // Flush pending literals at a worthwhile run, or at the end
+        if (i == n || run >= 4) {
+            while (literal < i) {
+                int count = std::min(128, i - literal);
+                *p++ = count;
+                memcpy(p, src + literal, count);
+                p += count;
+                literal += count;
+            }
+            if (i == n) break;
+            *p++ = 128 + run;
+            *p++ = src[i];
+            literal = i + run;
+        }
+        i += run;
+    }
+    return p - out;
+}
+
+static bool rleDecode(const unsigned char *&src, const unsigned char *end, unsigned char *dst, int n) {
+    for (int i = 0; i < n; ) {
+        if (src >= end) return false;
+        int count = *src++;
+        if (count > 128) {
+            count -= 128;
+            if (src >= end || count > n - i) return false;
+            memset(dst + i, *src++, count);
+        } else {
+            if (count == 0 || count > n - i || count > end - src) return false;
+            memcpy(dst + i, src, count);
+            src += count;
+        }
+        i += count;
+    }
+    return true;
+}
+
+// Encode the planes in c.scratch as a tiled payload at out, coding each
+// tile channel as the smallest of a copy, a literal and, unless this is a
+// key, a delta against the previous frame in c.planes. Returns its size.
+static size_t encodeTiles(const Container &c, bool key, unsigned char *out) {
+    const ContainerHeader *h = c.header;
+    size_t planeBytes = (size_t) h->width * h->height;
+    int tiles = tilesAcross(h->width) * tilesAcross(h->height);
+    uint32_t *ends = (uint32_t *) out;
+    unsigned char *data = out + tiles * sizeof(uint32_t), *p = data;
+    const int n = tileSize * tileSize;
+    unsigned char bytes[4][n], residual[n], coded[n + n / 128 + 1];
+    for (int t = 0; t < tiles; t++) {
+        Tile tile = tileAt(h, t);
+        int count = tile.w * tile.h;
+        for (int ch = 0; ch < 4; ch++) {
+            gatherTile(c.scratch + ch * planeBytes, h->width, tile, bytes[ch]);
+            if (ch > 0 && memcmp(bytes[ch], bytes[ch - 1], count) == 0) {
+                *p++ = TILE_COPY;
+                continue;
+            }
+            unsigned char *mode = p++;
+            *mode = TILE_LITERAL;
+            size_t size = rleEncode(bytes[ch], count, p);
+            if (!key) {
+                gatherTile(c.planes + ch * planeBytes, h->width, tile, residual);
+                for (int i = 0; i < count; i++) residual[i] = bytes[ch][i] - residual[i];
+                size_t deltaSize = rleEncode(residual, count, coded);
+                if (deltaSize < size) {
+                    *mode = TILE_DELTA;
+                    memcpy(p, coded, deltaSize);
+                    size = deltaSize;
+                }
+            }
+            p += size;
+        }
+        ends[t] = p - data;
+    }
+    return p - out;
+}
+
+// Apply tiles first to last of a tiled payload to planes
+static bool decodeTiles(const ContainerHeader *h, const unsigned char *payload, size_t bytes,
+                        bool key, unsigned char *planes, int first, int last) {
+    size_t planeBytes = (size_t) h->width * h->height;
+    int tiles = tilesAcross(h->width) * tilesAcross(h->height);
+    const uint32_t *ends = (const uint32_t *) payload;
+    if (bytes < tiles * sizeof(uint32_t)) return false;
+    const unsigned char *data = payload + tiles * sizeof(uint32_t);
+    size_t dataBytes = bytes - tiles * sizeof(uint32_t);
+    unsigned char run[tileSize * tileSize];
+    for (int t = first; t < last; t++) {
+        Tile tile = tileAt(h, t);
+        int count = tile.w * tile.h;
+        uint32_t begin = t > 0 ? ends[t - 1] : 0;
+        if (begin > ends[t] || ends[t] > dataBytes) return false;
+        const unsigned char *p = data + begin, *end = data + ends[t];
+        for (int ch = 0; ch < 4; ch++) {
+            unsigned char *plane = planes + ch * planeBytes;
+            if (p >= end) return false;
+            int mode = *p++;
+            if (mode == TILE_COPY && ch > 0) {
+                for (int y = 0; y < tile.h; y++) {
+                    size_t row = (size_t) (tile.y0 + y) * h->width + tile.x0;
+                    memcpy(plane + row, plane - planeBytes + row, tile.w);
+                }
+            } else if (mode == TILE_LITERAL) {
+                if (!rleDecode(p, end, run, count)) return false;
+                scatterTile(run, h->width, tile, plane);
+            } else if (mode == TILE_DELTA && !key) {
+                if (!rleDecode(p, end, run, count)) return false;
+                for (int y = 0; y < tile.h; y++) {
+                    unsigned char *row = plane + (size_t) (tile.y0 + y) * h->width + tile.x0;
+                    for (int x = 0; x < tile.w; x++) row[x] += run[y * tile.w + x];
+                }
+            } else {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Run body(part) for parts 0 to parts - 1, one per thread, with the
+// calling thread taking part 0
+template <class F> static void runParts(int parts, F body) {
+    std::vector<std::thread> threads;
+    for (int part = 1; part < parts; part++) threads.push_back(std::thread(body, part));
+    body(0);
+    for (auto &t : threads) t.join();
+}
+
+static void resetContainer(Container &c) {
+    c.fd = -1;
+    c.map = NULL;
+    c.mapBytes = c.frameBytes = 0;
+    c.writable = false;
+    c.header = NULL;
+    c.index = NULL;
+    c.keyInterval = 0;
+    c.planes = c.scratch = NULL;
+    c.decoded = -1;
+    c.pending = 0;
+    c.payload = NULL;
+    c.rows = NULL;
+}
+
+static bool mapContainer(Container &c, const char *path) {
+    int prot = c.writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(NULL, c.mapBytes, prot, MAP_SHARED, c.fd, 0);
+    if (map == MAP_FAILED) {
+        perror(path);
+        close(c.fd);
+        resetContainer(c);
+        return false;
+    }
+    c.map = (unsigned char *) map;
+    c.header = (ContainerHeader *) c.map;
+    return true;
+}
+
+bool containerCreate(Container &c, const char *path, int width, int height, int capacity, int keyInterval) {
+    resetContainer(c);
+    c.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (c.fd < 0) {
+        perror(path);
+        return false;
+    }
+    c.writable = true;
+    c.frameBytes = keyInterval ? worstTiledBytes(width, height) : worstFrameBytes(width, height);
+    size_t indexOffset = pageBytes;
+    size_t dataOffset = roundUp(indexOffset + capacity * sizeof(ContainerEntry), pageBytes);
+    c.mapBytes = dataOffset + capacity * c.frameBytes;
+    if (ftruncate(c.fd, c.mapBytes) != 0) {
+        perror(path);
+        close(c.fd);
+        resetContainer(c);
+        return false;
+    }
+    if (!mapContainer(c, path)) return false;
+    ContainerHeader *h = c.header;
+    memcpy(h->magic, containerMagic, sizeof(h->magic));
+    h->width = width;
+    h->height = height;
+    h->capacity = capacity;
+    h->count = 0;
+    h->indexOffset = indexOffset;
+    h->dataOffset = h->dataEnd = dataOffset;
+    c.index = (ContainerEntry *) (c.map + indexOffset);
+    if (keyInterval) {
+        c.keyInterval = keyInterval;
+        c.planes = (unsigned char *) malloc((size_t) width * height * 4);
+        c.scratch = (unsigned char *) malloc((size_t) width * height * 4);
+        if (c.planes == NULL || c.scratch == NULL) {
+            fprintf(stderr, "Out of memory for delta frames\n");
+            containerClose(c);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rows of a tiled frame, packed straight into the planes it is encoded from
+class PlaneRows : public RowSink {
+public:
+    PlaneRows(unsigned char *planes, int width, int height)
+        : planes(planes), width(width), planeBytes((size_t) width * height) {}
+    void row(int y, const float *rgb) { RGBE_PackPlanes(rgb, planes + (size_t) y * width, planeBytes, width); }
+private:
+    unsigned char *planes;
+    int width;
+    size_t planeBytes;
+};
+
+// The RGBE writer only speaks stdio, so a .hdr payload is encoded in place
+// through a memory stream pointed at the mapped slot
+RowSink *containerBegin(Container &c, int frame) {
+    ContainerHeader *h = c.header;
+    if (!c.writable || h->count >= h->capacity || c.rows) {
+        fprintf(stderr, "Container is full, read-only or mid-frame\n");
+        return NULL;
+    }
+    c.pending = frame;
+    if (c.keyInterval) {
+        c.rows = new PlaneRows(c.scratch, h->width, h->height);
+        return c.rows;
+    }
+    c.payload = fmemopen(c.map + h->dataEnd, c.frameBytes, "wb");
+    if (c.payload == NULL) {
+        perror("fmemopen");
+        return NULL;
+    }
+    if (RGBE_WriteHeader(c.payload, h->width, h->height, NULL) != RGBE_RETURN_SUCCESS) {
+        fclose(c.payload);
+        c.payload = NULL;
+        fprintf(stderr, "Couldn't encode frame %i into the container\n", frame);
+        return NULL;
+    }
+    c.rows = new HdrRows(c.payload);
+    return c.rows;
+}
+
+bool containerCommit(Container &c) {
+    ContainerHeader *h = c.header;
+    ContainerEntry &e = c.index[h->count];
+    bool ok = true;
+    if (c.keyInterval) {
+        bool key = h->count % c.keyInterval == 0;
+        e.bytes = encodeTiles(c, key, c.map + h->dataEnd);
+        e.encoding = key ? PAYLOAD_KEY : PAYLOAD_DELTA;
+        // The frame just written is what the next one is coded against
+        std::swap(c.planes, c.scratch);
+    } else {
+        ok = ((HdrRows *) c.rows)->ok() && fflush(c.payload) == 0;
+        long bytes = ftell(c.payload);
+        fclose(c.payload);
+        c.payload = NULL;
+        ok = ok && bytes > 0;
+        e.bytes = bytes;
+        e.encoding = PAYLOAD_HDR;
+    }
+    delete c.rows;
+    c.rows = NULL;
+    if (!ok) {
+        fprintf(stderr, "Couldn't encode frame %i into the container\n", c.pending);
+        return false;
+    }
+    e.offset = h->dataEnd;
+    e.frame = c.pending;
+    h->dataEnd = roundUp(h->dataEnd + e.bytes, payloadAlign);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool containerAppend(Container &c, int frame, float *rgb) {
+    RowSink *rows = containerBegin(c, frame);
+    if (rows == NULL) return false;
+    int width = c.header->width, height = c.header->height;
+    const int blockRows = 64;
+    rows->begin(width, blockRows);
+    for (int y = 0; y < height; y++) {
+        rows->row(y, rgb + (size_t) y * width * 3);
+        if ((y + 1) % blockRows == 0 || y + 1 == height) rows->flush(y + 1);
+    }
+    return containerCommit(c);
+}
+
+void containerClose(Container &c) {
+    if (c.payload) fclose(c.payload);
+    delete c.rows;
+    c.payload = NULL;
+    c.rows = NULL;
+    free(c.planes);
+    free(c.scratch);
+    c.planes = c.scratch = NULL;
+    if (c.map == NULL) return;
+    uint64_t end = c.writable ? c.header->dataEnd : 0;
+    if (c.writable) msync(c.map, c.mapBytes, MS_SYNC);
+    munmap(c.map, c.mapBytes);
+    // Give back the reserve the run didn't use
+    if (c.writable && ftruncate(c.fd, end) != 0) perror("ftruncate");
+    close(c.fd);
+    resetContainer(c);
+}
+
+bool containerOpen(Container &c, const char *path) {
+    resetContainer(c);
+    c.fd = open(path, O_RDONLY);
+    struct stat st;
+    if (c.fd < 0 || fstat(c.fd, &st) != 0) {
+        perror(path);
+        if (c.fd >= 0) close(c.fd);
+        resetContainer(c);
+        return false;
+    }
+    c.mapBytes = st.st_size;
+    if (c.mapBytes < sizeof(ContainerHeader)) {
+        fprintf(stderr, "%s: not a frame container\n", path);
+        close(c.fd);
+        resetContainer(c);
+        return false;
+    }
+    if (!mapContainer(c, path)) return false;
+    ContainerHeader *h = c.header;
+    if ((memcmp(h->magic, containerMagic, sizeof(h->magic)) != 0
+         && memcmp(h->magic, hdrOnlyMagic, sizeof(h->magic)) != 0)
+        || h->indexOffset + h->capacity * sizeof(ContainerEntry) > c.mapBytes) {
+        fprintf(stderr, "%s: not a frame container\n", path);
+        containerClose(c);
+        return false;
+    }
+    c.index = (ContainerEntry *) (c.map + h->indexOffset);
+    return true;
+}
+
+const unsigned char *containerFrame(const Container &c, int i, size_t &bytes) {
+    uint32_t count = __atomic_load_n(&c.header->count, __ATOMIC_ACQUIRE);
+    if (i < 0 || i >= count) return NULL;
+    const ContainerEntry &e = c.index[i];
+    if (e.offset + e.bytes > c.mapBytes) return NULL;
+    bytes = e.bytes;
+    return c.map + e.offset;
+}
+
+bool containerDecode(Container &c, int i, float *rgb, int threads) {
+    size_t bytes;
+    const unsigned char *payload = containerFrame(c, i, bytes);
+    if (payload == NULL) {
+        fprintf(stderr, "No entry %i in the container\n", i);
+        return false;
+    }
+    const ContainerHeader *h = c.header;
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (c.index[i].encoding == PAYLOAD_HDR) {
+        int width, height;
+        size_t headerBytes;
+        return RGBE_ReadHeaderMem(payload, bytes, &width, &height, NULL, &headerBytes) == RGBE_RETURN_SUCCESS
+            && width == (int) h->width && height == (int) h->height
+            && RGBE_ReadPixelsMem(payload + headerBytes, bytes - headerBytes, rgb, width, height, threads) == RGBE_RETURN_SUCCESS;
+    }
+    size_t planeBytes = (size_t) h->width * h->height;
+    if (c.planes == NULL) c.planes = (unsigned char *) malloc(planeBytes * 4);
+    if (c.planes == NULL) {
+        fprintf(stderr, "Out of memory for delta frames\n");
+        return false;
+    }
+    // Replay from the key unless the planes already hold a frame on the way
+    int from = i;
+    while (c.index[from].encoding == PAYLOAD_DELTA && from > 0) from--;
+    if (c.index[from].encoding != PAYLOAD_KEY) {
+        fprintf(stderr, "Entry %i has no key frame to start from\n", i);
+        return false;
+    }
+    if (c.decoded >= from && c.decoded <= i) from = c.decoded + 1;
+    int tiles = tilesAcross(h->width) * tilesAcross(h->height);
+    threads = std::min(threads, tiles);
+    for (int k = from; k <= i; k++) {
+        payload = containerFrame(c, k, bytes);
+        bool key = c.index[k].encoding == PAYLOAD_KEY;
+        std::atomic<bool> ok(true);
+        runParts(threads, [&](int part) {
+            if (!decodeTiles(h, payload, bytes, key, c.planes, (long) tiles * part / threads,
+                             (long) tiles * (part + 1) / threads)) ok = false;
+        });
+        if (!ok) {
+            fprintf(stderr, "Entry %i is corrupt\n", k);
+            c.decoded = -1;
+            return false;
+        }
+        c.decoded = k;
+    }
+    runParts(threads, [&](int part) {
+        size_t first = planeBytes * part / threads, last = planeBytes * (part + 1) / threads;
+        RGBE_UnpackPlanes(c.planes + first, planeBytes, rgb + first * 3, last - first);
+    });
+    return true;
+}
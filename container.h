@@ -0,0 +1,97 @@
+#ifndef POPCORN_CONTAINER_H
+#define POPCORN_CONTAINER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "rowsink.h"
+
+// A whole frame sequence in one file. Layout, all offsets from file start:
+//
+//   0             ContainerHeader
+//   indexOffset   capacity ContainerEntry records, one per frame slot
+//   dataOffset    frame payloads, appended in render order on 64-byte
+//                 boundaries
+//
+// A payload is either a complete .hdr file (RGBE header plus RLE pixels)
+// or, in a delta-compressed container, a tiled frame. Tiled frames work on
+// the frame's RGBE bytes split into r, g, b and e planes and cut into
+// tileSize square tiles. The payload starts with the end offset of every
+// tile's data, counted from the end of that table, so tiles can be found
+// and decoded independently. Each tile then holds, per channel, a mode
+// byte and the bytes for that mode:
+//
+//   TILE_COPY      nothing: same bytes as the previous channel of the tile
+//   TILE_LITERAL   the tile's bytes, RLE coded as in .hdr scanlines
+//   TILE_DELTA     the bytewise difference from the previous frame, RLE
+//
+// A key frame never uses TILE_DELTA; a delta frame is reconstructed by
+// applying it to the frame before, back to the last key. Encodings are
+// lossless on the RGBE bytes, so every frame decodes to exactly the pixels
+// a .hdr would hold.
+//
+// The file is sized for capacity worst-case frames up front (sparse, so
+// only written payloads use disk) and trimmed to dataEnd when closed. A
+// frame's entry is complete before count is raised, so a reader of a file
+// still being written only ever sees whole frames.
+
+struct ContainerHeader {
+    char magic[8];                  // "POPSEQ2"; "POPSEQ1" files hold only .hdr
+    uint32_t width, height;
+    uint32_t capacity, count;
+    uint64_t indexOffset, dataOffset, dataEnd;
+};
+
+struct ContainerEntry {
+    uint64_t offset, bytes;         // payload position and length
+    int32_t frame;                  // frame number it was rendered as
+    uint32_t encoding;              // PayloadEncoding
+};
+
+enum PayloadEncoding { PAYLOAD_HDR, PAYLOAD_KEY, PAYLOAD_DELTA };
+enum TileMode { TILE_COPY, TILE_LITERAL, TILE_DELTA };
+
+const int tileSize = 64;
+
+struct Container {
+    int fd;
+    unsigned char *map;
+    size_t mapBytes, frameBytes;
+    bool writable;
+    ContainerHeader *header;
+    ContainerEntry *index;
+    // Tiled frames: a key every keyInterval frames, 0 for .hdr payloads.
+    // planes holds the RGBE planes of the last frame written, or of entry
+    // decoded when reading; scratch the frame being encoded.
+    int keyInterval;
+    unsigned char *planes, *scratch;
+    int decoded;
+    // The frame being appended: its number, the stream a .hdr payload is
+    // encoded through, and the sink its rows go to
+    int pending;
+    FILE *payload;
+    RowSink *rows;
+};
+
+// Writing. Frames are encoded straight into the mapping, as .hdr payloads
+// or, with a keyInterval, as tiled key and delta frames. A frame is either
+// appended whole from width*height RGB floats, or streamed: rows go to the
+// sink containerBegin() returns, typically from Renderer::resolve(), and
+// containerCommit() then adds the frame. All return false (or NULL) after
+// reporting the problem on stderr.
+bool containerCreate(Container &c, const char *path, int width, int height, int capacity, int keyInterval);
+bool containerAppend(Container &c, int frame, float *rgb);
+RowSink *containerBegin(Container &c, int frame);
+bool containerCommit(Container &c);
+void containerClose(Container &c);
+
+// Reading. Frames are addressed by their position in the file, and the
+// returned payload points into the mapping: no copy, valid until close.
+bool containerOpen(Container &c, const char *path);
+const unsigned char *containerFrame(const Container &c, int i, size_t &bytes);
+// Decode entry i of any encoding into width*height RGB floats, on threads
+// threads (0 for one per online cpu). Reading forward from the last entry
+// decoded applies one delta; anything else replays from the nearest key.
+bool containerDecode(Container &c, int i, float *rgb, int threads);
+
+#endif
@@ -0,0 +1,14 @@
+#include "kernels.h"
+#include <string.h>
+
+// Widest first
+static const Kernels *const candidates[] = {&kernelsAvx512, &kernelsAvx2, &kernelsSse2, &kernelsScalar};
+
+const Kernels *selectKernels(const char *force) {
+    for (int i = 0; i < sizeof(candidates)/sizeof(candidates[0]); i++) {
+        const Kernels *k = candidates[i];
+        if (force && strcmp(force, k->name) != 0) continue;
+        if (k->supported()) return k;
+    }
+    return NULL;
+}
@@ -0,0 +1,14 @@
+#include "exposure.h"
+#include <math.h>
+
+void Exposure::update(const Histogram &h, float scale) {
+    if (h.total == 0) return;
+    double target = log(h.percentile(percentile) * scale / white);
+    // The first frame has nothing to glide from
+    logScale = primed ? logScale + smoothing * (target - logScale) : target;
+    primed = true;
+}
+
+float Exposure::dampenFrame() const {
+    return exp(logScale);
+}
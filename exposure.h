@@ -0,0 +1,25 @@
+#ifndef POPCORN_EXPOSURE_H
+#define POPCORN_EXPOSURE_H
+
+#include "popcorn.h"
+
+// Automatic exposure. Each resolved frame's histogram sets the dampenFrame
+// that puts the given percentile of its lit pixels at white. The scale is
+// smoothed in log space across frames, so the brightness glides as the
+// attractor spreads and collapses instead of flickering with it.
+struct Exposure {
+    float percentile;       // fraction of lit pixels at or below white
+    float white;            // saved-frame value the percentile maps to
+    float smoothing;        // weight of the newest frame
+    double logScale;        // log of the smoothed dampenFrame
+    bool primed;
+
+    Exposure() : percentile(.995), white(1), smoothing(.15), logScale(0), primed(false) {}
+    // Fold in a frame's histogram, read scale times brighter to stand for a
+    // whole frame when it was counted from fewer orbits; ignored when it has
+    // no lit pixels
+    void update(const Histogram &h, float scale);
+    float dampenFrame() const;
+};
+
+#endif
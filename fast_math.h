@@ -0,0 +1,137 @@
+/* Reduced-precision SSE sin and cos for the orbit kernels.
+
+   The full Cephes versions in sse_math.h are accurate to a couple of ulps
+   over a huge range, which a density plot has no use for. The variants here
+   trade that for speed:
+
+   - one range reduction to r = x - k*Pi, |r| <= Pi/2, with the sign of the
+     result taken from the parity of k. Pi is split in three (the Cephes
+     DP1..DP3 constants scaled by 4), which keeps the reduction accurate
+     for |x| < 1e4. The arguments f and g produce are |t| + |y| + 1 at most.
+   - a single minimax polynomial per function on [-Pi/2, Pi/2], instead of
+     two polynomials and a select.
+   - Horner steps fused into FMAs when the target has them.
+
+   Two tiers are provided, with maximum absolute error measured over
+   |x| < 1e4:
+     *_fast_ps    degree 7 sine / degree 8 cosine, error < 1e-6
+     *_draft_ps   degree 5 sine / degree 6 cosine, error < 1e-4
+
+   Define TRIG_TIER as 0 (Cephes), 1 (fast) or 2 (draft) to choose which set
+   sin_tier_ps, cos_tier_ps and sincos_tier_ps use.
+*/
+
+#ifndef POPCORN_FAST_MATH_H
+#define POPCORN_FAST_MATH_H
+
+#include "sse_math.h"
+#include <emmintrin.h>
+#ifdef __FMA__
+# include <immintrin.h>
+# define FMADD_PS(a, b, c) _mm_fmadd_ps(a, b, c)
+#else
+# define FMADD_PS(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#endif
+
+/* Reduction constants and polynomial coefficients, highest degree first.
+   Shared with the wider vector types in simd.h. */
+static const float fm_inv_pi = 0.31830988618379067f;
+static const float fm_pi_split[3] = {
+  3.140625f, 9.67502593994140625e-4f, 1.509957990978376432e-7f };
+/* minimax sin(r)/r and cos(r) on [-Pi/2, Pi/2], as polynomials in r*r */
+static const float fm_sin7[4] = {
+  -1.8363654e-4f, 8.3063252e-3f, -1.6664828e-1f, 9.9999662e-1f };
+static const float fm_cos8[5] = {
+  2.3153933e-5f, -1.3853704e-3f, 4.1663585e-2f, -4.9999905e-1f, 9.9999995e-1f };
+static const float fm_sin5[3] = {
+  7.5143772e-3f, -1.6567308e-1f, 9.9969677e-1f };
+static const float fm_cos6[4] = {
+  -1.2712095e-3f, 4.1487748e-2f, -4.9991244e-1f, 9.9999330e-1f };
+
+/* x = k*Pi + r. Returns r and the sign flip (-1)^k as a sign-bit mask. */
+static inline v4sf reduce_pi_ps(v4sf x, v4sf *sign) {
+  v4si k = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(fm_inv_pi)));
+  v4sf kf = _mm_cvtepi32_ps(k);
+  x = FMADD_PS(kf, _mm_set1_ps(-fm_pi_split[0]), x);
+  x = FMADD_PS(kf, _mm_set1_ps(-fm_pi_split[1]), x);
+  x = FMADD_PS(kf, _mm_set1_ps(-fm_pi_split[2]), x);
+  *sign = _mm_castsi128_ps(_mm_slli_epi32(k, 31));
+  return x;
+}
+
+static inline v4sf horner_ps(v4sf z, const float *c, int n) {
+  v4sf p = _mm_set1_ps(c[0]);
+  for (int i = 1; i < n; i++) p = FMADD_PS(p, z, _mm_set1_ps(c[i]));
+  return p;
+}
+
+static inline v4sf sin_poly7_ps(v4sf r, v4sf z) {
+  return _mm_mul_ps(horner_ps(z, fm_sin7, 4), r);
+}
+
+static inline v4sf cos_poly8_ps(v4sf z) {
+  return horner_ps(z, fm_cos8, 5);
+}
+
+static inline v4sf sin_poly5_ps(v4sf r, v4sf z) {
+  return _mm_mul_ps(horner_ps(z, fm_sin5, 3), r);
+}
+
+static inline v4sf cos_poly6_ps(v4sf z) {
+  return horner_ps(z, fm_cos6, 4);
+}
+
+static inline v4sf sin_fast_ps(v4sf x) {
+  v4sf sign, r = reduce_pi_ps(x, &sign);
+  return _mm_xor_ps(sin_poly7_ps(r, _mm_mul_ps(r, r)), sign);
+}
+
+static inline v4sf cos_fast_ps(v4sf x) {
+  v4sf sign, r = reduce_pi_ps(x, &sign);
+  return _mm_xor_ps(cos_poly8_ps(_mm_mul_ps(r, r)), sign);
+}
+
+/* both results from one reduction; sin and cos share the sign flip */
+static inline void sincos_fast_ps(v4sf x, v4sf *s, v4sf *c) {
+  v4sf sign, r = reduce_pi_ps(x, &sign);
+  v4sf z = _mm_mul_ps(r, r);
+  *s = _mm_xor_ps(sin_poly7_ps(r, z), sign);
+  *c = _mm_xor_ps(cos_poly8_ps(z), sign);
+}
+
+static inline v4sf sin_draft_ps(v4sf x) {
+  v4sf sign, r = reduce_pi_ps(x, &sign);
+  return _mm_xor_ps(sin_poly5_ps(r, _mm_mul_ps(r, r)), sign);
+}
+
+static inline v4sf cos_draft_ps(v4sf x) {
+  v4sf sign, r = reduce_pi_ps(x, &sign);
+  return _mm_xor_ps(cos_poly6_ps(_mm_mul_ps(r, r)), sign);
+}
+
+static inline void sincos_draft_ps(v4sf x, v4sf *s, v4sf *c) {
+  v4sf sign, r = reduce_pi_ps(x, &sign);
+  v4sf z = _mm_mul_ps(r, r);
+  *s = _mm_xor_ps(sin_poly5_ps(r, z), sign);
+  *c = _mm_xor_ps(cos_poly6_ps(z), sign);
+}
+
+#ifndef TRIG_TIER
+# define TRIG_TIER 0
+#endif
+
+#if TRIG_TIER == 2
+# define sin_tier_ps    sin_draft_ps
+# define cos_tier_ps    cos_draft_ps
+# define sincos_tier_ps sincos_draft_ps
+#elif TRIG_TIER == 1
+# define sin_tier_ps    sin_fast_ps
+# define cos_tier_ps    cos_fast_ps
+# define sincos_tier_ps sincos_fast_ps
+#else
+# define sin_tier_ps    sin_ps
+# define cos_tier_ps    cos_ps
+# define sincos_tier_ps sincos_ps
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef POPCORN_FIELD_H
+#define POPCORN_FIELD_H
+
+// Included by kernel.cpp inside its per-instruction-set namespace, with
+// Params and PI from renderstate.h, and by renderer.cpp for the periods
+
+/******************************* USERS SHOULD EDIT HERE *******************************/
+
+// Written once for every batch width: V is float or one of the vector types
+// from simd.h, whose sin and cos follow TRIG_TIER (see fast_math.h). P is
+// Params, or in sweep mode LaneParams<V>, whose t0..t3 differ per lane.
+template <class P, class V> V f(const P &p, V x, V y) {
+    return cos(p.t0 + y + sin(p.t1 + PI * x));
+}
+template <class P, class V> V g(const P &p, V x, V y) {
+    return cos(p.t2 + y + cos(p.t3 + PI * x));
+}
+
+// Periods both f and g repeat with in x and in y, whatever the coefficients.
+// The field grid mode (-g) samples one such cell.
+const float fieldPeriodX = 2, fieldPeriodY = 2*PI;
+
+/**************************************************************************************/
+
+#endif
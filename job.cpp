@@ -0,0 +1,90 @@
+#include "job.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+const char *channelNames[channelCount] = {
+    "t0", "t1", "t2", "t3", "offsetx", "offsety", "intensifyScreen", "dampenFrame"
+};
+
+static const char *interpNames[] = {"linear", "smooth", "step"};
+
+void Curve::add(float frame, float value, Interp interp) {
+    Key key = {frame, value, interp};
+    std::vector<Key>::iterator at = keys.begin();
+    while (at != keys.end() && at->frame <= frame) at++;
+    keys.insert(at, key);
+}
+
+float Curve::at(float frame) const {
+    if (keys.empty()) return 0;
+    if (frame <= keys.front().frame) return keys.front().value;
+    if (frame >= keys.back().frame) return keys.back().value;
+    int k = 0;
+    while (keys[k + 1].frame <= frame) k++;
+    const Key &a = keys[k], &b = keys[k + 1];
+    float span = b.frame - a.frame;
+    float u = (frame - a.frame) / span;
+    switch (a.interp) {
+        case INTERP_STEP:
+            return a.value;
+        case INTERP_SMOOTH: {
+            // Catmull-Rom tangents from the neighbouring keys, scaled to this segment
+            const Key &prev = keys[std::max(k - 1, 0)];
+            const Key &next = keys[std::min(k + 2, (int) keys.size() - 1)];
+            float ma = (b.value - prev.value) / (b.frame - prev.frame) * span;
+            float mb = (next.value - a.value) / (next.frame - a.frame) * span;
+            float u2 = u*u, u3 = u2*u;
+            return (2*u3 - 3*u2 + 1)*a.value + (u3 - 2*u2 + u)*ma
+                 + (-2*u3 + 3*u2)*b.value + (u3 - u2)*mb;
+        }
+        default:
+            return a.value + (b.value - a.value)*u;
+    }
+}
+
+bool loadJob(const char *path, Job &job) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    job = Job();
+    job.name = path;
+    job.firstFrame = 1;
+    job.lastFrame = 0;
+    char line[1024];
+    bool ok = true;
+    for (int lineNum = 1; ok && fgets(line, sizeof(line), file); lineNum++) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = 0;
+        char word[64], channel[64], interp[64], output[1024];
+        float frame, value;
+        if (sscanf(line, "%63s", word) != 1) continue;
+        if (strcmp(word, "frames") == 0) {
+            ok = sscanf(line, "%*s %d %d", &job.firstFrame, &job.lastFrame) == 2
+                 && job.firstFrame <= job.lastFrame;
+        } else if (strcmp(word, "output") == 0) {
+            ok = sscanf(line, "%*s %1023s", output) == 1;
+            if (ok) job.output = output;
+        } else if (strcmp(word, "key") == 0) {
+            int fields = sscanf(line, "%*s %63s %f %f %63s", channel, &frame, &value, interp);
+            int c = 0, i = 0;
+            while (c < channelCount && fields >= 1 && strcmp(channel, channelNames[c]) != 0) c++;
+            if (fields == 4) {
+                while (i < 3 && strcmp(interp, interpNames[i]) != 0) i++;
+            }
+            ok = fields >= 3 && c < channelCount && i < 3;
+            if (ok) job.curves[c].add(frame, value, (Interp) i);
+        } else {
+            ok = false;
+        }
+        if (!ok) fprintf(stderr, "%s:%i: can't parse \"%s\"\n", path, lineNum, word);
+    }
+    fclose(file);
+    if (ok && job.lastFrame < job.firstFrame) {
+        fprintf(stderr, "%s: no frames line\n", path);
+        ok = false;
+    }
+    return ok;
+}
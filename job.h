@@ -0,0 +1,54 @@
+#ifndef POPCORN_JOB_H
+#define POPCORN_JOB_H
+
+#include <string>
+#include <vector>
+
+// An animation job: a frame range, an output prefix and one keyframed
+// curve per animatable value. Job files are plain text, one directive per
+// line, with # starting a comment:
+//
+//   frames 1 2048                 first and last frame, inclusive
+//   output renders/run1_          frame files become renders/run1_<n>.hdr
+//   key t0 1 -2                   key <channel> <frame> <value> [interp]
+//   key t0 2048 8.235 smooth
+//
+// Channels are t0 t1 t2 t3 offsetx offsety intensifyScreen dampenFrame.
+// The interpolation named on a key applies to the segment that starts
+// there: linear (default), smooth (Catmull-Rom) or step. Curves hold their
+// first and last values outside their keys, and a channel without keys
+// takes the renderer's built-in value. Jobs run in the order given.
+
+enum Interp { INTERP_LINEAR, INTERP_SMOOTH, INTERP_STEP };
+
+enum Channel {
+    CHANNEL_T0, CHANNEL_T1, CHANNEL_T2, CHANNEL_T3,
+    CHANNEL_OFFSETX, CHANNEL_OFFSETY,
+    CHANNEL_INTENSIFY, CHANNEL_DAMPEN,
+    channelCount
+};
+
+extern const char *channelNames[channelCount];
+
+struct Key {
+    float frame, value;
+    Interp interp;
+};
+
+struct Curve {
+    std::vector<Key> keys;     // sorted by frame
+    bool empty() const { return keys.empty(); }
+    void add(float frame, float value, Interp interp = INTERP_LINEAR);
+    float at(float frame) const;
+};
+
+struct Job {
+    std::string name, output;
+    int firstFrame, lastFrame;
+    Curve curves[channelCount];
+};
+
+// Parse a job file, reporting problems on stderr. Returns false on error.
+bool loadJob(const char *path, Job &job);
+
+#endif
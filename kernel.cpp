@@ -0,0 +1,553 @@
+// The orbit, splat, reduction and tone-map kernels. The Makefile compiles
+// this file once per instruction set with that set's flags, and the USE_*
+// macro picks which table it exports. Everything else sits in an anonymous
+// namespace, so the copies never meet at link time and none can be swapped
+// for another's template instances. Library code used here should be the
+// kind that always inlines, since its out-of-line copies are shared.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#ifdef  __SSE__
+#include <x86intrin.h>
+#endif
+#include "kernels.h"
+#include "renderstate.h"
+
+namespace {
+
+#include "simd.h"
+
+// Coefficients that differ per lane, for sweep mode
+template <class V> struct LaneParams {
+    V t0, t1, t2, t3;
+};
+
+#include "field.h"
+
+// Where orbits get their velocity: f and g themselves, or a bilinear lookup
+// in the field grid of the frame (see FieldGrid in renderstate.h)
+struct ExactField {
+    Params p;
+    template <class V> void velocity(V x, V y, V &dx, V &dy) const {
+        dx = f(p, x, y); dy = g(p, x, y);
+    }
+};
+
+struct GridField {
+    const float *samples;
+    float scaleX, scaleY, shiftX, shiftY;
+    float nx, ny, invNx, invNy, row, size;
+
+    explicit GridField(const FieldGrid &grid)
+        : samples(&grid.samples[0]), scaleX(grid.scaleX), scaleY(grid.scaleY),
+          shiftX(grid.shiftX), shiftY(grid.shiftY), nx(grid.nx), ny(grid.ny),
+          invNx(1.0f / grid.nx), invNy(1.0f / grid.ny), row(2 * (grid.nx + 1)), size(grid.samples.size()) {}
+
+    // Sample indices are whole floats, so the wrap and the gathers need no
+    // integer vector ops
+    template <class V> void velocity(V x, V y, V &dx, V &dy) const {
+        V u = (x + shiftX) * scaleX, w = (y + shiftY) * scaleY;
+        V i = floorPositive(u), j = floorPositive(w);
+        V fu = u - i, fw = w - j;
+        i = i - floorPositive(i * invNx) * nx;
+        j = j - floorPositive(j * invNy) * ny;
+        V at = i * 2.0f + j * row;
+        dx = bilinear(at, fu, fw);
+        dy = bilinear(at + 1.0f, fu, fw);
+    }
+
+    template <class V> V bilinear(V at, V fu, V fw) const {
+        V a = gather(samples, at, size), b = gather(samples, at + 2.0f, size);
+        V c = gather(samples, at + row, size), d = gather(samples, at + (row + 2), size);
+        V top = a + (b - a) * fu, bottom = c + (d - c) * fu;
+        return top + (bottom - top) * fw;
+    }
+};
+
+template <class V, class F> void traceOrbits(RenderState&, const F&, long, int);
+template <class V, class F> void popcornIterate(const F&, const Params&, const View&, const StartSequence&, float*, long, int);
+template <class V, class F> void popcornContinue(const F&, const Params&, const View&, float, float*, LiveOrbits&, int);
+template <class V, class F> void traceBlock(const F&, const Params&, const View&, float*, V*, V*);
+float nextRandom(uint32_t&);
+void seedOrbit(LiveOrbits&, int);
+void startPoints(const StartSequence&, long, int, float*, float*);
+template <class V> void toView(const Params&, const View&, V&, V&);
+template <class V> void prefetchSplats(const Params&, const View&, const float*, V, V);
+template <class V> void popcornSweep(const Params&, const View&, const Sweep&, const StartSequence&, float*, long, int);
+template <class V> void insert(const Params&, const View&, float*, V, V);
+template <class V> void splat(const View&, float*, V, V, unsigned);
+template <class V> void splatFirstRow(const View&, float*, V, V, unsigned);
+#if defined(USE_AVX512) && defined(USE_SCATTER) && defined(__AVX512CD__)
+template <> void splat<vfloat16>(const View&, float*, vfloat16, vfloat16, unsigned);
+#endif
+void zeroFloats(float*, long);
+
+void calc(RenderState &s, long samples, int worker) {
+    if (s.grid.active) {
+        traceOrbits<Batch>(s, GridField(s.grid), samples, worker);
+    } else {
+        ExactField exact = {s.params};
+        traceOrbits<Batch>(s, exact, samples, worker);
+    }
+}
+
+// samples counts orbits, so every batch width renders the same density. A
+// continued orbit counts once per iterMax steps, the same splats as a fresh one.
+// The parameters and view are copied first, so the splat stores can't be
+// taken to alias them and force reloads.
+template <class V, class F> void traceOrbits(RenderState &s, const F &field, long samples, int worker) {
+    const int lanes = Lanes<V>::count * orbitBlock;
+    const Params p = s.params;
+    const View view = s.view;
+    const StartSequence sequence = s.sequence;
+    float *buffer = s.buffers[worker];
+    for (;;) {
+        long start = s.nextOrbit.fetch_add(chunkOrbits, std::memory_order_relaxed);
+        if (start >= samples) return;
+        long end = std::min(start + chunkOrbits, samples);
+        for (long orbit = start; orbit < end; orbit += lanes) {
+            int active = std::min((long)lanes, end - orbit);
+            if (s.sweep.count) {
+                popcornSweep<V>(p, view, s.sweep, sequence, buffer, orbit, active);
+            } else if (s.continueOrbits) {
+                popcornContinue<V>(field, p, view, s.reseedRate, buffer, s.workerOrbits[worker], active);
+            } else {
+                popcornIterate<V>(field, p, view, sequence, buffer, orbit, active);
+            }
+            if (s.cancel.load(std::memory_order_relaxed)) return;
+        }
+    }
+}
+
+// Trace one block of orbits from the pass index first of its first orbit.
+// Lanes past active start as NaN, which insert() masks out, so a budget that
+// isn't a multiple of the width is kept exactly.
+template <class V, class F> void popcornIterate(const F &field, const Params &p, const View &view, const StartSequence &sequence,
+                                                float *buffer, long first, int active) {
+    const int lanes = Lanes<V>::count, n = lanes * orbitBlock;
+    alignas(64) float startX[n], startY[n];
+    startPoints(sequence, first, active, startX, startY);
+    for (int i = active; i < n; i++) startX[i] = startY[i] = NAN;
+    V x[orbitBlock], y[orbitBlock];
+    for (int k = 0; k < orbitBlock; k++) {
+        x[k] = loadLanes<V>(startX + k*lanes) * internwidth;
+        y[k] = loadLanes<V>(startY + k*lanes) * internheight;
+    }
+    traceBlock(field, p, view, buffer, x, y);
+}
+
+// Advance a block of independent batches iterMax steps. One batch's f and g
+// are a long dependent chain of sin/cos; stepping the whole block in one loop
+// body lets the chains of the others fill the idle ports. Splats run a step
+// behind the math, so each step's targets are prefetched a full block of
+// field evaluations before they are written.
+template <class V, class F> void traceBlock(const F &field, const Params &p, const View &view, float *buffer, V *x, V *y) {
+    V px[orbitBlock], py[orbitBlock];
+    for (int i = 0; i < iterMax; i++) {
+        for (int k = 0; k < orbitBlock; k++) {
+            px[k] = x[k]; py[k] = y[k];
+            V dx, dy;
+            field.velocity(x[k], y[k], dx, dy);
+            x[k] = x[k] + dx; y[k] = y[k] + dy;
+        }
+        for (int k = 0; k < orbitBlock; k++) prefetchSplats(p, view, buffer, x[k], y[k]);
+        if (i > 0) {
+            for (int k = 0; k < orbitBlock; k++) insert(p, view, buffer, px[k], py[k]);
+        }
+    }
+    for (int k = 0; k < orbitBlock; k++) insert(p, view, buffer, x[k], y[k]);
+}
+
+// Advance the next block of a worker's live orbits by iterMax steps. Orbits
+// carry over between calls and frames, since the field changes only a little
+// from one frame to the next. An orbit is re-seeded once it leaves the view,
+// once it stalls (the field has sinks, and a parked orbit would pile its
+// splats onto one pixel) and otherwise with probability reseedRate per call.
+template <class V, class F> void popcornContinue(const F &field, const Params &p, const View &view, float reseedRate,
+                                                 float *buffer, LiveOrbits &orbits, int active) {
+    const int lanes = Lanes<V>::count, n = lanes * orbitBlock;
+    if (orbits.x.empty()) {
+        orbits.x.resize(liveOrbits);
+        orbits.y.resize(liveOrbits);
+        for (int i = 0; i < liveOrbits; i++) seedOrbit(orbits, i);
+    }
+    int base = orbits.next;
+    orbits.next = (base + n) % liveOrbits;
+    float *ox = &orbits.x[base], *oy = &orbits.y[base];
+    alignas(64) float px[n], py[n];
+    for (int i = 0; i < n; i++) {
+        px[i] = i < active ? ox[i] : NAN;
+        py[i] = i < active ? oy[i] : NAN;
+    }
+    V x[orbitBlock], y[orbitBlock];
+    for (int k = 0; k < orbitBlock; k++) {
+        x[k] = loadLanes<V>(px + k*lanes); y[k] = loadLanes<V>(py + k*lanes);
+    }
+    traceBlock(field, p, view, buffer, x, y);
+    for (int k = 0; k < orbitBlock; k++) {
+        storeLanes(x[k], px + k*lanes); storeLanes(y[k], py + k*lanes);
+    }
+    for (int i = 0; i < active; i++) {
+        float moved = fabsf(px[i] - ox[i]) * view.wmul + fabsf(py[i] - oy[i]) * view.hmul;
+        ox[i] = px[i]; oy[i] = py[i];
+        float sx = (px[i] + (internwidth + 2*p.offsetx)) * view.wmul;
+        float sy = (py[i] + (internheight + 2*p.offsety)) * view.hmul;
+        if (!(inRange(sx, view.width) && inRange(sy, view.imageHeight)) || moved < 1 || nextRandom(orbits.rng) < reseedRate) {
+            seedOrbit(orbits, base + i);
+        }
+    }
+}
+
+// Sweep mode: trace a block of fresh orbits with every lane on its own
+// variant of the coefficients, from the pass index first of the block's
+// first orbit, and splat each into its variant's tile of the screen
+template <class V> void popcornSweep(const Params &p, const View &view, const Sweep &sweep, const StartSequence &sequence,
+                                     float *buffer, long first, int active) {
+    const int lanes = Lanes<V>::count, n = lanes * orbitBlock;
+    alignas(64) float startX[n], startY[n];
+    startPoints(sequence, first, active, startX, startY);
+    for (int i = active; i < n; i++) startX[i] = startY[i] = NAN;
+    V x[orbitBlock], y[orbitBlock], ox[orbitBlock], oy[orbitBlock];
+    LaneParams<V> lp[orbitBlock];
+    for (int k = 0; k < orbitBlock; k++) {
+        x[k] = loadLanes<V>(startX + k*lanes) * internwidth;
+        y[k] = loadLanes<V>(startY + k*lanes) * internheight;
+        int at = (first + k*lanes) % sweep.count;
+        lp[k].t0 = loadLanes<V>(&sweep.t0[at]); lp[k].t1 = loadLanes<V>(&sweep.t1[at]);
+        lp[k].t2 = loadLanes<V>(&sweep.t2[at]); lp[k].t3 = loadLanes<V>(&sweep.t3[at]);
+        ox[k] = loadLanes<V>(&sweep.originX[at]); oy[k] = loadLanes<V>(&sweep.originY[at]);
+    }
+    for (int i = 0; i < iterMax; i++) {
+        for (int k = 0; k < orbitBlock; k++) {
+            V dx = f(lp[k], x[k], y[k]), dy = g(lp[k], x[k], y[k]);
+            x[k] = x[k] + dx; y[k] = y[k] + dy;
+        }
+        for (int k = 0; k < orbitBlock; k++) {
+            V tx = (x[k] + (internwidth + 2*p.offsetx)) * sweep.scaleX;
+            V ty = (y[k] + (internheight + 2*p.offsety)) * sweep.scaleY;
+            unsigned live = inRange(tx, sweep.tileWidth) & inRange(ty, sweep.tileHeight);
+            splat(view, buffer, tx + ox[k], ty + oy[k], live);
+        }
+    }
+}
+
+// xorshift32, returning a float in [0, 1)
+float nextRandom(uint32_t &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / (1 << 24));
+}
+
+// Start orbit i at a random point in the view. There is no burn-in: the
+// image is made of the paths orbits take towards the sinks, not the sinks.
+void seedOrbit(LiveOrbits &orbits, int i) {
+    orbits.x[i] = (nextRandom(orbits.rng)*2 - 1) * internwidth;
+    orbits.y[i] = (nextRandom(orbits.rng)*2 - 1) * internheight;
+}
+
+// The R2 sequence steps x and y by 1/phi and 1/phi^2 modulo 1, phi being the
+// plastic constant, which spreads any run of consecutive points evenly over
+// the square, in 64-bit fixed point so the wrap stays exact at any index.
+// Adding the frame's rotation, also modulo 1, scrambles it. Orbits first to
+// first + count - 1 of the pass get points in [-1, 1).
+const uint64_t r2StepX = 0xc13fa9a902a6328full, r2StepY = 0x91e10da5c79e7b1cull;
+
+void startPoints(const StartSequence &sequence, long first, int count, float *x, float *y) {
+    uint64_t n = sequence.base + first;
+    uint64_t ux = n * r2StepX + sequence.rotateX, uy = n * r2StepY + sequence.rotateY;
+    for (int i = 0; i < count; i++) {
+        x[i] = (ux >> 40) * (2.0f / (1 << 24)) - 1;
+        y[i] = (uy >> 40) * (2.0f / (1 << 24)) - 1;
+        ux += r2StepX; uy += r2StepY;
+    }
+}
+
+// Field coordinates to pixel coordinates from the top row of the view
+template <class V> inline void toView(const Params &p, const View &view, V &x, V &y) {
+    x = (x + (internwidth + 2*p.offsetx)) * view.wmul;
+    y = (y + (internheight + 2*p.offsety)) * view.hmul - view.top;
+}
+
+// Ask for the two buffer rows a batch will splat into, skipping the lanes
+// insert() would mask out. Truncation is floor for the lanes kept.
+template <class V> void prefetchSplats(const Params &p, const View &view, const float *buffer, V x, V y) {
+    toView(p, view, x, y);
+    unsigned live = inRange(x, view.width) & inRange(y, view.rows);
+    const int lanes = Lanes<V>::count;
+    alignas(64) int xi[lanes], yi[lanes];
+    storeInts(x, xi); storeInts(y, yi);
+    while (live) {
+        int i = __builtin_ctz(live);
+        live &= live - 1;
+        const float *corner = buffer + BXY(xi[i], yi[i]);
+        __builtin_prefetch(corner, 1);
+        __builtin_prefetch(corner + view.stride, 1);
+    }
+}
+
+// Splat a batch of points. Lanes whose top-left corner falls off screen (or
+// that went NaN) are masked out, except that a corner up to a row above the
+// view still lands its bottom corners on the first row. In a banded render
+// the band above drops those into its padding row, so without them the
+// first row of every later band would come out dark.
+template <class V> void insert(const Params &p, const View &view, float *buffer, V x, V y) {
+    toView(p, view, x, y);
+    unsigned across = inRange(x, view.width);
+    splat(view, buffer, x, y, across & inRange(y, view.rows));
+    unsigned above = across & inRange(y + 1.0f, 1);
+    if (above) splatFirstRow(view, buffer, x, y + 1.0f, above);
+}
+
+// Splat the live lanes of a batch at view pixel coordinates, visiting only
+// those lanes
+template <class V> void splat(const View &view, float *buffer, V x, V y, unsigned live) {
+    if (live == 0) return;
+    V x0 = floorPositive(x), y0 = floorPositive(y);
+    V xfac = x - x0, yfac = y - y0;
+    V ixfac = 1.0f - xfac, iyfac = 1.0f - yfac;
+    const int lanes = Lanes<V>::count;
+    alignas(64) int x0i[lanes], y0i[lanes];
+    alignas(64) float w00[lanes], w10[lanes], w01[lanes], w11[lanes];
+    storeInts(x0, x0i); storeInts(y0, y0i);
+    storeLanes(ixfac * iyfac, w00); storeLanes(xfac * iyfac, w10);
+    storeLanes(ixfac * yfac, w01); storeLanes(xfac * yfac, w11);
+    while (live) {
+        int i = __builtin_ctz(live);
+        live &= live - 1;
+        float *corner = buffer + BXY(x0i[i], y0i[i]);
+        corner[0] += w00[i];
+        corner[1] += w10[i];
+        corner[view.stride] += w01[i];
+        corner[view.stride + 1] += w11[i];
+    }
+}
+
+// The bottom half of a splat whose top-left corner is a row above the view,
+// given below, the point's distance down from that row
+template <class V> void splatFirstRow(const View &view, float *buffer, V x, V below, unsigned live) {
+    V x0 = floorPositive(x);
+    V xfac = x - x0;
+    const int lanes = Lanes<V>::count;
+    alignas(64) int x0i[lanes];
+    alignas(64) float w01[lanes], w11[lanes];
+    storeInts(x0, x0i);
+    storeLanes((1.0f - xfac) * below, w01); storeLanes(xfac * below, w11);
+    while (live) {
+        int i = __builtin_ctz(live);
+        live &= live - 1;
+        buffer[x0i[i]] += w01[i];
+        buffer[x0i[i] + 1] += w11[i];
+    }
+}
+
+#if defined(USE_AVX512) && defined(USE_SCATTER) && defined(__AVX512CD__)
+// The same splat without leaving the registers: each corner is gathered,
+// weighted and scattered back. Lanes that hit the same pixel would lose all
+// but one add in a scatter, so vpconflictd finds them and they go in later
+// rounds; every round takes the lanes with no earlier clash among those left.
+// Neighbouring lanes can add to a shared pixel in another order than the
+// scalar loop's, so the sums match it within float rounding, not bit for bit.
+template <> void splat<vfloat16>(const View &view, float *buffer, vfloat16 x, vfloat16 y, unsigned live) {
+    __mmask16 todo = live;
+    if (todo == 0) return;
+    vfloat16 x0 = floorPositive(x), y0 = floorPositive(y);
+    vfloat16 xfac = x - x0, yfac = y - y0;
+    vfloat16 ixfac = 1.0f - xfac, iyfac = 1.0f - yfac;
+    __m512i index = _mm512_add_epi32(_mm512_cvttps_epi32(x0.v),
+                                     _mm512_mullo_epi32(_mm512_cvttps_epi32(y0.v), _mm512_set1_epi32(view.stride)));
+    const int offsets[4] = {0, 1, view.stride, view.stride + 1};
+    const __m512 weights[4] = {(ixfac * iyfac).v, (xfac * iyfac).v, (ixfac * yfac).v, (xfac * yfac).v};
+    __m512i clashes = _mm512_maskz_conflict_epi32(todo, index);
+    while (todo) {
+        __m512i pending = _mm512_and_epi32(clashes, _mm512_set1_epi32(todo));
+        __mmask16 ready = _mm512_mask_testn_epi32_mask(todo, pending, pending);
+        for (int c = 0; c < 4; c++) {
+            __m512i at = _mm512_add_epi32(index, _mm512_set1_epi32(offsets[c]));
+            __m512 sum = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), ready, at, buffer, 4);
+            _mm512_mask_i32scatter_ps(buffer, ready, at, _mm512_add_ps(sum, weights[c]), 4);
+        }
+        todo &= ~ready;
+    }
+}
+#endif
+
+// Sample f and g into this worker's share of the field grid rows. The last
+// row and column are sampled at the wrapped point, so they repeat the first
+// exactly.
+void buildField(RenderState &s, int worker) {
+    const int lanes = Lanes<Batch>::count;
+    const Params p = s.params;
+    FieldGrid &grid = s.grid;
+    const int rowLength = grid.nx + 1, rows = grid.ny + 1;
+    int j0 = (long) rows * worker / s.pool->size(), j1 = (long) rows * (worker + 1) / s.pool->size();
+    alignas(64) float xs[lanes], dx[lanes], dy[lanes];
+    for (int j = j0; j < j1; j++) {
+        float *out = &grid.samples[(size_t) j * rowLength * 2];
+        Batch y = (j % grid.ny) / grid.scaleY;
+        for (int i = 0; i < rowLength; i += lanes) {
+            for (int k = 0; k < lanes; k++) xs[k] = ((i + k) % grid.nx) / grid.scaleX;
+            Batch x = loadLanes<Batch>(xs);
+            storeLanes(f(p, x, y), dx);
+            storeLanes(g(p, x, y), dy);
+            for (int k = 0; k < lanes && i + k < rowLength; k++) {
+                out[2*(i + k)] = dx[k];
+                out[2*(i + k) + 1] = dy[k];
+            }
+        }
+    }
+}
+
+// This worker's share of fieldErrorPoints random points over a period cell:
+// the largest distance between the looked-up and the exact step, and the
+// sum of the squared distances
+void fieldError(RenderState &s, int worker, float &maxError, double &sumSquares) {
+    const int lanes = Lanes<Batch>::count;
+    ExactField exact = {s.params};
+    GridField grid(s.grid);
+    long n0 = (long) fieldErrorPoints * worker / s.pool->size();
+    long n1 = (long) fieldErrorPoints * (worker + 1) / s.pool->size();
+    uint32_t rng = 0x2545f491u * (worker + 1);
+    alignas(64) float xs[lanes], ys[lanes], ex[lanes], ey[lanes], gx[lanes], gy[lanes];
+    maxError = 0;
+    sumSquares = 0;
+    for (long n = n0; n < n1; n += lanes) {
+        for (int k = 0; k < lanes; k++) {
+            xs[k] = nextRandom(rng) * fieldPeriodX;
+            ys[k] = nextRandom(rng) * fieldPeriodY;
+        }
+        Batch x = loadLanes<Batch>(xs), y = loadLanes<Batch>(ys), dx, dy;
+        exact.velocity(x, y, dx, dy);
+        storeLanes(dx, ex); storeLanes(dy, ey);
+        grid.velocity(x, y, dx, dy);
+        storeLanes(dx, gx); storeLanes(dy, gy);
+        for (int k = 0; k < lanes && n + k < n1; k++) {
+            float error = hypotf(gx[k] - ex[k], gy[k] - ey[k]);
+            maxError = std::max(maxError, error);
+            sumSquares += error * error;
+        }
+    }
+}
+
+// Zero a run of floats with non-temporal stores, so clearing a buffer that
+// was just reduced doesn't pull it back through the cache. The fence makes
+// the zeros visible before the caller's next pass starts.
+void zeroFloats(float *dst, long count) {
+    long i = 0;
+#ifdef  __SSE__
+    for (; i < count && ((uintptr_t) (dst + i) & 15); i++) dst[i] = 0;
+    __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) _mm_stream_ps(dst + i, zero);
+#endif
+    for (; i < count; i++) dst[i] = 0;
+#ifdef  __SSE__
+    _mm_sfence();
+#endif
+}
+
+// One row of a node fold: the thread buffers of the node summed into its
+// partial-sum buffer. With consume set, each thread buffer row is zeroed
+// right after it is read.
+void foldRow(RenderState &s, int node, int y, bool consume) {
+    const View &view = s.view;
+    float *out = s.nodeBuffers[node] + BXY(0, y);
+    bool first = true;
+    for (int i = 0; i < s.buffers.size(); i++) {
+        if (s.pool->nodeOf(i) != node) continue;
+        float *in = s.buffers[i] + BXY(0, y);
+        if (first) {
+            memcpy(out, in, view.width*sizeof(float));
+            first = false;
+        } else {
+            for (int x = 0; x < view.width; x++) out[x] += in[x];
+        }
+        if (consume) zeroFloats(in, view.stride);
+    }
+}
+
+// Total density of row y, taken from the node partial sums when they exist.
+// With consume set, thread buffer rows read here are zeroed; node partial
+// sums need no clearing since the next fold overwrites them.
+void sumRow(RenderState &s, int y, float *out, bool consume) {
+    const View &view = s.view;
+    bool fromNodes = !s.nodeBuffers.empty();
+    const std::vector<float*> &sources = fromNodes ? s.nodeBuffers : s.buffers;
+    memcpy(out, sources[0] + BXY(0, y), view.width*sizeof(float));
+    for (int i = 1; i < sources.size(); i++) {
+        const float *in = sources[i] + BXY(0, y);
+        for (int x = 0; x < view.width; x++) out[x] += in[x];
+    }
+    if (consume && !fromNodes) {
+        for (int i = 0; i < sources.size(); i++) zeroFloats(sources[i] + BXY(0, y), view.stride);
+    }
+}
+
+// Histogram bin of a lit pixel, straight from the float's exponent and top
+// two mantissa bits
+inline void countPixel(uint32_t *histogram, float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    int bin = (int) (bits >> 21) - ((127 + histogramLow) << 2);
+    histogram[std::min(std::max(bin, 0), histogramBins - 1)]++;
+}
+
+void toneScreen(RenderState &s, int y, const float *row, uint32_t *histogram) {
+    const float intensifyScreen = s.params.intensifyScreen;
+    uint32_t *pixels = s.pixels;
+    for (int x = 0; x < width; x++) {
+        float v = sqrtf(row[x]);
+        pixels[XY(x, y)] = std::min(v*intensifyScreen, 255.0f);
+        if (v > 0) countPixel(histogram, v);
+    }
+}
+
+void toneFrame(RenderState &s, const float *row, float *rgb, uint32_t *histogram) {
+    const float dampenFrame = s.params.dampenFrame;
+    const int rowWidth = s.view.width;
+    for (int x = 0; x < rowWidth; x++) {
+        float v = sqrtf(row[x]);
+        float col = v/dampenFrame;
+        float* pixel = rgb + 3*x;
+        pixel[0] = col; pixel[1] = col; pixel[2] = col;
+        if (v > 0) countPixel(histogram, v);
+    }
+}
+
+// Every feature this copy was compiled to use
+bool supported() {
+    __builtin_cpu_init();
+    bool ok = true;
+#ifdef  __SSE2__
+    ok = ok && __builtin_cpu_supports("sse2");
+#endif
+#ifdef  __AVX2__
+    ok = ok && __builtin_cpu_supports("avx2");
+#endif
+#ifdef  __FMA__
+    ok = ok && __builtin_cpu_supports("fma");
+#endif
+#ifdef  __AVX512F__
+    ok = ok && __builtin_cpu_supports("avx512f");
+#endif
+#ifdef  __AVX512CD__
+    ok = ok && __builtin_cpu_supports("avx512cd");
+#endif
+    return ok;
+}
+
+}
+
+#if defined(USE_AVX512)
+extern const Kernels kernelsAvx512 = {"avx512",
+#elif defined(USE_AVX2)
+extern const Kernels kernelsAvx2 = {"avx2",
+#elif defined(USE_SSE2)
+extern const Kernels kernelsSse2 = {"sse2",
+#else
+extern const Kernels kernelsScalar = {"scalar",
+#endif
+    supported, calc, buildField, fieldError, foldRow, sumRow, zeroFloats, toneScreen, toneFrame
+};
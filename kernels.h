@@ -0,0 +1,41 @@
+#ifndef POPCORN_KERNELS_H
+#define POPCORN_KERNELS_H
+
+// The hot loops, built once per instruction set from kernel.cpp. The
+// renderer calls them through the table picked at startup, so one binary
+// runs the widest path each host supports. All state comes in through the
+// RenderState of the renderer making the call.
+#include <stdint.h>
+
+struct RenderState;
+
+struct Kernels {
+    const char *name;
+    // Whether this CPU has every feature the table was compiled for
+    bool (*supported)();
+    // Trace orbits until the pass counter reaches samples
+    void (*calc)(RenderState &s, long samples, int worker);
+    // Fill one worker's share of the field grid rows from f and g, and
+    // measure one worker's share of the grid's step error against them
+    void (*buildField)(RenderState &s, int worker);
+    void (*fieldError)(RenderState &s, int worker, float &maxError, double &sumSquares);
+    // Sum the thread buffers of one node into its partial-sum buffer for row y
+    void (*foldRow)(RenderState &s, int node, int y, bool consume);
+    // Total density of row y, from the node partial sums when they exist
+    void (*sumRow)(RenderState &s, int y, float *out, bool consume);
+    // Zero a run of floats with non-temporal stores
+    void (*zeroFloats)(float *dst, long count);
+    // Tone map a summed row into row y of the preview, or into a row of
+    // view width RGB floats for the saved frame, counting its pixels into
+    // histogram
+    void (*toneScreen)(RenderState &s, int y, const float *row, uint32_t *histogram);
+    void (*toneFrame)(RenderState &s, const float *row, float *rgb, uint32_t *histogram);
+};
+
+extern const Kernels kernelsScalar, kernelsSse2, kernelsAvx2, kernelsAvx512;
+
+// The widest supported table, or the one named by force if it is supported.
+// Returns NULL when force names nothing usable.
+const Kernels *selectKernels(const char *force);
+
+#endif
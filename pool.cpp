@@ -0,0 +1,69 @@
+#include "pool.h"
+
+WorkerPool::WorkerPool(const CpuTopology &topo)
+    : nodes(topo.nodeCount), generation(0), pending(0), stopping(false) {
+    nodeSize.assign(nodes, 0);
+    for (int i = 0; i < topo.cpus.size(); i++) {
+        int node = topo.nodeOfCpu[i];
+        workerNode.push_back(node);
+        workerRank.push_back(nodeSize[node]++);
+    }
+    for (int i = 0; i < topo.cpus.size(); i++) {
+        workers.push_back(std::thread(&WorkerPool::workerLoop, this, i, topo.cpus[i]));
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (int i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void WorkerPool::run(const std::function<void(int)> &work) {
+    start(work);
+    wait();
+}
+
+void WorkerPool::start(const std::function<void(int)> &work) {
+    std::lock_guard<std::mutex> guard(lock);
+    job = work;
+    pending = workers.size();
+    generation++;
+    wake.notify_all();
+}
+
+void WorkerPool::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return pending == 0; });
+}
+
+bool WorkerPool::waitFor(int milliseconds) {
+    std::unique_lock<std::mutex> guard(lock);
+    return done.wait_for(guard, std::chrono::milliseconds(milliseconds),
+                         [this] { return pending == 0; });
+}
+
+void WorkerPool::workerLoop(int worker, int cpu) {
+    pinThreadToCpu(cpu);
+    unsigned long seen = 0;
+    for (;;) {
+        std::function<void(int)> *current;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            current = &job;
+        }
+        (*current)(worker);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (--pending == 0) done.notify_one();
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef POPCORN_POOL_H
+#define POPCORN_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "topology.h"
+
+// A fixed set of worker threads, one pinned to each CPU in the topology.
+// Work is handed out as a job that every worker runs once with its index.
+class WorkerPool {
+public:
+    WorkerPool(const CpuTopology &topo);
+    ~WorkerPool();
+
+    int size() const { return workers.size(); }
+    int nodeCount() const { return nodes; }
+    int nodeOf(int worker) const { return workerNode[worker]; }
+    // Position of a worker among the workers of its node, and how many share it
+    int rankInNode(int worker) const { return workerRank[worker]; }
+    int workersInNode(int node) const { return nodeSize[node]; }
+
+    // Run job(worker) on every worker and wait for all of them to finish
+    void run(const std::function<void(int)> &job);
+    // The same, split so the caller can keep working while the job runs.
+    // Only one job may be in flight at a time.
+    // waitFor() returns whether the job finished within the timeout.
+    void start(const std::function<void(int)> &job);
+    void wait();
+    bool waitFor(int milliseconds);
+
+private:
+    void workerLoop(int worker, int cpu);
+
+    std::vector<std::thread> workers;
+    std::vector<int> workerNode, workerRank, nodeSize;
+    int nodes;
+
+    std::mutex lock;
+    std::condition_variable wake, done;
+    std::function<void(int)> job;
+    unsigned long generation;
+    int pending;
+    bool stopping;
+};
+
+#endif
@@ -1,326 +1,658 @@
 #include <SDL.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 #include <algorithm>
 #include <string.h>
-#include <future>
-#include <thread>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
 #include <vector>
+#include "alloc.h"
+#include "container.h"
+#include "exposure.h"
+#include "job.h"
+#include "kernels.h"
+#include "preview.h"
+#include "renderer.h"
+#include "schedule.h"
 extern "C" {
     #include "rgbe.h"
-    #ifdef  USE_SSE2
-    #include <x86intrin.h>
-    #endif
 };
-#ifdef  USE_SSE2
-#include "sse_math.h"
-#endif
-
-// Constants
-const int width = 1920, height = width*.5625;
-const float internwidth = 2, internheight = 1.125;
-float offsetx = 0, offsety = .57; float dty = -.115;
+
+// Constants (the screen size and the renderer's limits are in popcorn.h)
+const float dty = -.115;
 const float dt = .01;//, delta = 1;
-const int iterMax = 10, iterSteps = 1, frameIters = (1<<23);
+const int iterSteps = 1, frameIters = (1<<23);
+// Drift per frame of the default job, used when no job files are given
 const float s0 = .5, s1 = 1, s2 = -.3, s3 = 2;
-float t0 = -2, t1 = 1, t2 = 3, t3 = -4;
 bool running = true;
-float intensifyScreen = 4, dampenFrame = 512;
 const int preRoll = 0;
 const int endFrame = 2048;
-
-#ifdef USE_SSE2
-
-const __m128 PI_vec = _mm_set1_ps(3.141592654);
-const __m128 wmul = _mm_set1_ps(width/internwidth);
-const __m128 hmul = _mm_set1_ps(height/internheight);
-const __m128 rstartScale = _mm_set1_ps(2.0/1000000);
-const __m128 internXoff = _mm_set1_ps(internwidth + (2 * offsetx));
-const __m128 internYoff = _mm_set1_ps(internheight + (2 * offsety));
-__m128 t0_vec = _mm_set1_ps(t0), t1_vec = _mm_set1_ps(t1),
-        t2_vec = _mm_set1_ps(t2), t3_vec = _mm_set1_ps(t3);
-
-#endif
+// Orbits per worker in the pass that measures the rate for a time budget
+const long probeIters = 4*popcornChunkOrbits;
+// Interactive mode: size of the first pass after an edit, and step sizes
+const long previewIters = (1<<14);
+const float tuneStep = .05, fineTuneStep = .005, intensifyStep = 1.25;
 
 char *nameStub;
+const char *forceKernels = NULL;
+// Poster mode (-p): size of the image rendered band by band, 0 when off
+int posterWidth = 0, posterHeight = 0;
+bool interactive = false;
+bool continueOrbits = false;
+// Write each job's frames into one <prefix>.seq container (-C)
+bool containerOutput = false;
+// Delta-compress the container (-D n): tiled frames, a key every n
+int keyInterval = 0;
+// Run without a window (-H), and publish the preview for other processes
+// into a shared-memory ring (-s name)
+bool headless = false;
+const char *previewName = NULL;
+PreviewRing preview;
+// Time budgets (-b for the whole run, -B per frame) set the orbits per frame
+// in place of frameIters; budgetSpent ends the run at the deadline
+Schedule schedule;
+bool budgetSpent = false;
+// Automatic exposure (-e percentile): saved frames set their own dampenFrame
+// from the last one's histogram, overriding the job's
+bool autoExposure = false;
+Exposure exposure;
+// Field grid mode (-g n): orbits step through f and g sampled n times across
+// a period instead of evaluating them, 0 when off
+int gridSamples = 0;
+// Sweep mode (-S n:d0,d1,d2,d3): a contact sheet of n variants of t0..t3,
+// stepped by d0..d3 and centred on the current values, 0 when off
+int sweepCount = 0;
+float sweepStep[4];
+float reseedRate = 0;
+// The values the next pass renders with, handed to the renderer as each
+// pass or image starts
+Params params = defaultParams;
+// Values that can be tuned live, and the edits made to them while a pass is
+// still running. Keys that increase and decrease each one.
+float *tunables[] = {&params.t0, &params.t1, &params.t2, &params.t3, &params.offsetx, &params.offsety};
+const int tunableCount = sizeof(tunables)/sizeof(tunables[0]);
+float tuneEdits[tunableCount];
+// Values driven by the job curves, in job.h channel order, and the values
+// a job falls back to for channels it has no keys for
+float *channelValues[channelCount] = {&params.t0, &params.t1, &params.t2, &params.t3, &params.offsetx,
+                                      &params.offsety, &params.intensifyScreen, &params.dampenFrame};
+float channelDefaults[channelCount];
+std::vector<Job> jobs;
+bool tuned = false, retoned = false;
+const SDL_Keycode tuneInc[tunableCount] = {SDLK_q, SDLK_w, SDLK_e, SDLK_r, SDLK_RIGHT, SDLK_DOWN};
+const SDL_Keycode tuneDec[tunableCount] = {SDLK_a, SDLK_s, SDLK_d, SDLK_f, SDLK_LEFT, SDLK_UP};
 SDL_Window *window;
 SDL_Renderer *renderer;
 SDL_Texture *texture;
-Uint32 pixels[width*height];
-std::vector<float*> buffers;
-float frame[width*height][3];
-std::vector< std::future<void> > threads;
-
-#define XY(i, j)    ((i) + (j)*width)
-#define PI  3.141592654
-
-// Velocity field control functions for x and y respectively
-#ifdef  USE_SSE2
-__m128 f(__m128, __m128);
-__m128 g(__m128, __m128);
-#else
-float f(float, float);
-float g(float, float);
-#endif
-
-void popcornIterate(float*);
-#ifdef  USE_SSE2
-void insert(float*, __m128, __m128);
-#else
-void insert(float*, float, float);
-#endif
-void preparePixels();
-void prepareFrame();
-void updateCoefs();
+// The preview, filled in by the renderer. Finished frames are streamed
+// from it straight into their files.
+uint32_t *pixels;
+Renderer *popcorn;
+
+void allocateImages();
+float toneScale(long);
+void preparePixels(float);
+void prepareFrame(RowSink&, float);
+void applyExposure();
+Job defaultJob();
+void applyJob(const Job&, int);
+void renderJob(const Job&, int);
+void renderPoster(const char*);
 void drawScreen();
+void showPreview(int, long);
+void setTitle(const char*);
 void handleEvents();
-void clearData();
+void handleEvent(const SDL_Event&);
+void tune(int, float);
+void printTunables();
+void interactiveLoop();
 void quit(int);
-void calc(int, float*);
+void startPass(long);
+long runPass(long, double);
+double now();
 
 int main(int argc, char **argv) {
-    // Initialize SDL
-    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) quit(1);
-    SDL_SetHint("SDL_HINT_RENDER_SCALE_QUALITY", "1");
-    SDL_CreateWindowAndRenderer(std::min(width, 1280), std::min(height, 720), 0, &window, &renderer);
-    if (window == NULL) quit(1);
-    if (renderer == NULL) quit(1);
-    SDL_SetWindowTitle(window, "Starting render...");
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-
+    int opt;
+    while ((opt = getopt(argc, argv, "ij:c:CD:k:p:Hs:b:B:e:g:S:")) != -1) {
+        switch (opt) {
+            case 'i':
+                interactive = true;
+                break;
+            case 'H':
+                headless = true;
+                break;
+            case 's':
+                previewName = optarg;
+                break;
+            case 'b':
+                schedule.total = atof(optarg);
+                break;
+            case 'B':
+                schedule.perFrame = atof(optarg);
+                break;
+            case 'S':
+                if (sscanf(optarg, "%d:%f,%f,%f,%f", &sweepCount, &sweepStep[0], &sweepStep[1],
+                           &sweepStep[2], &sweepStep[3]) != 5 || sweepCount < 2 || sweepCount > 256) {
+                    fprintf(stderr, "bad sweep %s, expected count:d0,d1,d2,d3\n", optarg);
+                    quit(1);
+                }
+                break;
+            case 'g':
+                gridSamples = atoi(optarg);
+                if (gridSamples <= 0 || gridSamples > popcornMaxGridSamples) {
+                    fprintf(stderr, "bad field grid size %s\n", optarg);
+                    quit(1);
+                }
+                break;
+            case 'e':
+                autoExposure = true;
+                exposure.percentile = atof(optarg) / 100;
+                if (!(exposure.percentile > 0 && exposure.percentile < 1)) {
+                    fprintf(stderr, "bad exposure percentile %s\n", optarg);
+                    quit(1);
+                }
+                break;
+            case 'c':
+                continueOrbits = true;
+                reseedRate = atof(optarg);
+                break;
+            case 'k':
+                forceKernels = optarg;
+                break;
+            case 'C':
+                containerOutput = true;
+                break;
+            case 'D':
+                containerOutput = true;
+                keyInterval = atoi(optarg);
+                if (keyInterval <= 0) {
+                    fprintf(stderr, "bad key frame interval %s\n", optarg);
+                    quit(1);
+                }
+                break;
+            case 'p':
+                if (sscanf(optarg, "%dx%d", &posterWidth, &posterHeight) != 2
+                    || posterWidth <= 0 || posterHeight <= 0 || Renderer::maxViewRows(posterWidth) < 1) {
+                    fprintf(stderr, "bad poster size %s\n", optarg);
+                    quit(1);
+                }
+                break;
+            case 'j':
+                jobs.push_back(Job());
+                if (!loadJob(optarg, jobs.back())) quit(1);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-i] [-c reseed rate] [-C] [-D key interval] [-k scalar|sse2|avx2|avx512] [-p WxH] [-H] [-s shm name] [-b total sec] [-B sec per frame] [-e white percentile] [-g grid samples] [-S count:d0,d1,d2,d3] [-j job file]... [frame name prefix]\n", argv[0]);
+                quit(1);
+        }
+    }
     // Get name for frames
-    if (argc > 1) {
-        nameStub = argv[1];
+    if (optind < argc && !interactive) {
+        nameStub = argv[optind];
     } else {
         puts("No frame saving.");
     }
 
-    buffers.push_back(new float[width*height]);
-    for (int i = 1; i < std::min(std::thread::hardware_concurrency(), 64u); i++) {
-        buffers.push_back(new float[width*height]);
+    if (posterWidth && containerOutput) {
+        fprintf(stderr, "Posters are written as .hdr files, -C and -D don't apply\n");
+        quit(1);
+    }
+    if (schedule.active() && (interactive || posterWidth)) {
+        fprintf(stderr, "Time budgets apply to animation renders only\n");
+        quit(1);
+    }
+    if (autoExposure && (interactive || posterWidth)) {
+        fprintf(stderr, "Automatic exposure applies to animation renders only\n");
+        quit(1);
+    }
+    if (sweepCount && (posterWidth || gridSamples || continueOrbits)) {
+        fprintf(stderr, "Sweeps render fresh orbits on screen, -p, -g and -c don't apply\n");
+        quit(1);
+    }
+    if (interactive && headless) {
+        fprintf(stderr, "Interactive mode needs a window, -H doesn't apply\n");
+        quit(1);
     }
-    int threadCount = buffers.size();
 
-    long startTime = SDL_GetTicks();
-    // Pre-roll
-    int frameNum = preRoll;
-    for (int i = 0; i < frameNum; i++) {
-        updateCoefs();
+    // Initialize SDL. Headless runs still use it for timing and for quit
+    // signals, just without a window.
+    if (SDL_Init(headless ? SDL_INIT_TIMER | SDL_INIT_EVENTS : SDL_INIT_EVERYTHING) < 0) quit(1);
+    if (!headless) {
+        SDL_SetHint("SDL_HINT_RENDER_SCALE_QUALITY", "1");
+        SDL_CreateWindowAndRenderer(std::min(popcornWidth, 1280), std::min(popcornHeight, 720), 0, &window, &renderer);
+        if (window == NULL) quit(1);
+        if (renderer == NULL) quit(1);
+        SDL_SetWindowTitle(window, "Starting render...");
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, popcornWidth, popcornHeight);
     }
-    while (running) {
-        frameNum++;
+    if (previewName && !previewCreate(preview, previewName, popcornWidth, popcornHeight)) quit(1);
+
+    for (int c = 0; c < channelCount; c++) channelDefaults[c] = *channelValues[c];
+    if (jobs.empty()) jobs.push_back(defaultJob());
+
+    const Kernels *kernels = selectKernels(forceKernels);
+    if (kernels == NULL) {
+        fprintf(stderr, "%s kernels are not supported on this CPU\n", forceKernels);
+        quit(1);
+    }
+    printf("Using %s kernels\n", kernels->name);
+
+    popcorn = Renderer::create(detectTopology(), kernels);
+    if (popcorn == NULL) quit(1);
+    popcorn->continueOrbits = continueOrbits;
+    popcorn->reseedRate = reseedRate;
+    popcorn->gridSamples = gridSamples;
+    popcorn->sweepCount = sweepCount;
+    for (int c = 0; c < 4; c++) popcorn->sweepStep[c] = sweepStep[c];
+    if (sweepCount) {
+        printf("Sweep of %i variants, left to right and top to bottom: variant i at t0..t3 + (i - %g) * (%g, %g, %g, %g)\n",
+               sweepCount, (sweepCount - 1) / 2.0, sweepStep[0], sweepStep[1], sweepStep[2], sweepStep[3]);
+    }
+    allocateImages();
+
+    if (interactive) {
+        // Start exploring from the first frame of the first job
+        applyJob(jobs[0], jobs[0].firstFrame);
+        interactiveLoop();
+        quit(0);
+    }
+
+    // The queue shares one renderer; each frame leaves its buffers empty,
+    // so jobs run back to back without any reset
+    int frames = 0;
+    for (int i = 0; i < jobs.size(); i++) frames += jobs[i].lastFrame - jobs[i].firstFrame + 1;
+    schedule.begin(now(), frames);
+    for (int i = 0; i < jobs.size() && running && !budgetSpent; i++) {
+        renderJob(jobs[i], i);
+    }
+    // Without a rate every frame stops after its probe, far short of its share
+    if (schedule.active() && running && schedule.rate <= 0) {
+        fprintf(stderr, "Time budget: no pass was long enough to measure the orbit rate\n");
+    }
+    setTitle("Done");
+    // Leave the last frame up until the window is closed
+    while (running && window) {
+        handleEvents();
+    }
+    quit(0);
+}
+
+// The animation used when no job files are given: t0..t3 and offsety drift
+// linearly by s0..s3 and dty per dt, from preRoll frames in to endFrame
+Job defaultJob() {
+    Job job;
+    job.name = "default";
+    if (nameStub) job.output = nameStub;
+    job.firstFrame = preRoll + 1;
+    job.lastFrame = endFrame;
+    const float drift[] = {s0, s1, s2, s3, 0, dty};
+    for (int c = CHANNEL_T0; c <= CHANNEL_OFFSETY; c++) {
+        if (drift[c] == 0) continue;
+        job.curves[c].add(job.firstFrame, channelDefaults[c] + drift[c] * dt * (job.firstFrame - 1));
+        job.curves[c].add(job.lastFrame, channelDefaults[c] + drift[c] * dt * (job.lastFrame - 1));
+    }
+    return job;
+}
+
+// Set every animated value for the given frame of a job
+void applyJob(const Job &job, int frame) {
+    for (int c = 0; c < channelCount; c++) {
+        const Curve &curve = job.curves[c];
+        *channelValues[c] = curve.empty() ? channelDefaults[c] : curve.at(frame);
+    }
+}
+
+void renderJob(const Job &job, int index) {
+    // Frames go to the job's own prefix, or the one given on the command line
+    const char *stub = !job.output.empty() ? job.output.c_str() : nameStub;
+    Container sequence;
+    if (stub && containerOutput) {
+        char name[1024];
+        snprintf(name, sizeof(name), "%s.seq", stub);
+        if (!containerCreate(sequence, name, popcornWidth, popcornHeight, job.lastFrame - job.firstFrame + 1, keyInterval)) quit(1);
+    }
+    int threadCount = popcorn->threads();
+    long startTime = SDL_GetTicks();
+    printf("Job %i of %i: %s, frames %i to %i\n", index + 1, (int) jobs.size(),
+           job.name.c_str(), job.firstFrame, job.lastFrame);
+    for (int frameNum = job.firstFrame; frameNum <= job.lastFrame && running; frameNum++) {
+        applyJob(job, frameNum);
+        if (posterWidth) {
+            char name[1024];
+            if (stub) snprintf(name, sizeof(name), "%s%i.hdr", stub, frameNum);
+            renderPoster(stub ? name : NULL);
+            continue;
+        }
+        if (autoExposure && exposure.primed) applyExposure();
         long delta1 = 0, delta2 = 0, delta3 = 0, delta = 0;
         long d = SDL_GetTicks();
-        for (int total = 0; total < frameIters;) {
-            long a = SDL_GetTicks();
-            for (int i = 0; i < buffers.size(); i++) {
-                threads.push_back(std::async(std::launch::async, calc, frameIters/threadCount/iterSteps, buffers[i]));
-                total += frameIters/threadCount/iterSteps;
+        long frameSamples = frameIters;
+        double renderEnd = 0;
+        if (schedule.active()) {
+            double seconds = schedule.renderSeconds(now());
+            if (seconds < 0) {
+                printf("Time budget spent, stopping before frame %i of job %i\n", frameNum, index + 1);
+                budgetSpent = true;
+                break;
             }
-            for (int i = 0; i < threads.size(); i++) {
-                threads[i].wait();
+            renderEnd = now() + seconds;
+            // Until a pass has measured the rate, start with a probe
+            frameSamples = schedule.rate > 0 ? std::max(schedule.samplesFor(seconds), 1L)
+                                             : probeIters * popcorn->threads();
+        }
+        long total = 0;
+        for (long step = 0; total < frameSamples; step++) {
+            long a = SDL_GetTicks();
+            // Spread any remainder so the frame gets exactly frameIters orbits
+            long samples = schedule.active() ? frameSamples - total
+                                             : (long)frameIters*(step + 1)/iterSteps - total;
+            total += runPass(samples, renderEnd);
+            // On a budget, whatever time is left decides whether another pass
+            // is worth starting. A probe too short to time is followed by
+            // one twice as long, until the rate is known.
+            if (schedule.active()) {
+                long more = schedule.rate > 0 ? schedule.samplesFor(renderEnd - now())
+                          : now() < renderEnd ? 2*samples : 0;
+                frameSamples = total + (more >= (long) popcornChunkOrbits * popcorn->threads() ? more : 0);
             }
-            threads.clear();
-            /*for (int i = 0; i < iterStep; i++) {
-                popcornIterate(buffers[0]);
-                handleEvents();
-                total++;
-                if (!running) break;
-            }*/
             handleEvents();
             long b = SDL_GetTicks();
-            preparePixels();
-            drawScreen();
+            showPreview(frameNum, total);
             
             // Debug time output
             long c = SDL_GetTicks();
             delta1 += b - a; delta2 += c - b; delta3 += c - a; 
             if (!running) break;
         }
-        // Change the function coefficients for animation
-        updateCoefs();
         // Frame output
-        if (running && argc > 1) {
-            prepareFrame();
-            char name[1024];
-            sprintf(name, "%s%i.hdr", nameStub, frameNum);
-            FILE *img = fopen(name, "wb");
-            RGBE_WriteHeader(img, width, height, NULL);
-            RGBE_WritePixels_RLE(img, (float *) frame, width, height);
-            fclose(img);
+        if (running && stub) {
+            // The first frame has no earlier histogram, so it pays for one
+            // extra reduction of its own before it is resolved
+            float scale = toneScale(total);
+            if (autoExposure && !exposure.primed) {
+                preparePixels(scale);
+                exposure.update(popcorn->histogram(), scale);
+                if (exposure.primed) applyExposure();
+            }
+            if (containerOutput) {
+                RowSink *rows = containerBegin(sequence, frameNum);
+                if (rows == NULL) quit(1);
+                prepareFrame(*rows, scale);
+                if (!containerCommit(sequence)) quit(1);
+            } else {
+                char name[1024];
+                snprintf(name, sizeof(name), "%s%i.hdr", stub, frameNum);
+                FILE *img = fopen(name, "wb");
+                RGBE_WriteHeader(img, popcornWidth, popcornHeight, NULL);
+                HdrRows rows(img);
+                prepareFrame(rows, scale);
+                fclose(img);
+            }
+            if (autoExposure) exposure.update(popcorn->histogram(), scale);
         }
         delta = SDL_GetTicks() - d;
+        if (schedule.active()) schedule.finishFrame(delta/1000.0, delta1/1000.0);
         char title[512];
-        sprintf(title, "Rendering on %i threads    Frame %i out of %i    Frame time: %.2f sec (%.1f%% rendering, %.1f%% display, %.1f%% saving frames)   Total time: %.2f sec    ", 
-                    threadCount, frameNum, endFrame, delta/1000.0, 100.0 * delta1/delta, 100.0 * delta2/delta, 100.0 - 100.0*delta3/delta, (SDL_GetTicks()-startTime)/1000.0);
-        SDL_SetWindowTitle(window, title);
-        clearData();
-        if (frameNum >= endFrame) break;
-    }
-    SDL_SetWindowTitle(window, "Done");
-    while (running) {
-        handleEvents();
+        int length = snprintf(title, sizeof(title), "Rendering on %i threads    Job %i of %i    Frame %i out of %i    Frame time: %.2f sec (%.1f%% rendering, %.1f%% display, %.1f%% saving frames)   Job time: %.2f sec    ",
+                    threadCount, index + 1, (int) jobs.size(), frameNum, job.lastFrame, delta/1000.0, 100.0 * delta1/delta, 100.0 * delta2/delta, 100.0 - 100.0*delta3/delta, (SDL_GetTicks()-startTime)/1000.0);
+        if (schedule.active()) {
+            length += snprintf(title + length, sizeof(title) - length, "Rate: %.3g orbits/sec    Projected finish in %.0f sec    ",
+                               schedule.rate, schedule.projectedEnd(now()) - now());
+        }
+        if (gridSamples) {
+            float maxError, rmsError;
+            popcorn->gridError(maxError, rmsError);
+            snprintf(title + length, sizeof(title) - length, "Grid step error: %.2g px max, %.2g px rms    ",
+                     maxError, rmsError);
+        }
+        setTitle(title);
+        // prepareFrame() already emptied the buffers when the frame was saved
+        if (!(running && stub)) popcorn->clear();
     }
-    quit(0);
+    if (stub && containerOutput) containerClose(sequence);
 }
 
-/******************************* USERS SHOULD EDIT HERE *******************************/
-
-#ifndef USE_SSE2
-float f(float x, float y) {
-    return cosf(t0 + y + sinf(t1 + PI * x));
-}
-float g(float x, float y) {
-    return cosf(t2 + y + cosf(t3 + PI * x));
-}
-#else
-__m128 f(__m128 x, __m128 y) {
-    return cos_ps(_mm_add_ps(_mm_add_ps(t0_vec, y), sin_ps(_mm_add_ps(t1_vec, _mm_mul_ps(PI_vec, x)))));
-}
-__m128 g(__m128 x, __m128 y) {
-    return cos_ps(_mm_add_ps(_mm_add_ps(t2_vec, y), sin_ps(_mm_add_ps(t3_vec, _mm_mul_ps(PI_vec, x)))));
+// Render the current frame at poster size without ever holding it whole.
+// The poster is cut into full-width bands that fit the accumulation buffers.
+// Each band traces the whole orbit budget, keeps only the splats that land
+// inside it, and is encoded onto the end of the file before the next band
+// starts, so memory stays that of a screen-sized render. The budget is
+// frameIters scaled by area, which keeps the screen render's density, so
+// a poster costs about (area / screen area) * bands screen frames.
+void renderPoster(const char *name) {
+    int bandRows = std::min(Renderer::maxViewRows(posterWidth), popcornWidth * popcornHeight / posterWidth);
+    int bands = (posterHeight + bandRows - 1) / bandRows;
+    long budget = (double) frameIters * posterWidth * posterHeight / (popcornWidth * popcornHeight);
+    FILE *img = name ? fopen(name, "wb") : NULL;
+    if (img) RGBE_WriteHeader(img, posterWidth, posterHeight, NULL);
+    HdrRows rows(img);
+    long startTime = SDL_GetTicks();
+    for (int band = 0; band < bands && running; band++) {
+        int top = band * bandRows;
+        popcorn->setView(posterWidth, posterHeight, top, std::min(bandRows, posterHeight - top));
+        for (long step = 0, total = 0; total < budget && running; step++) {
+            long samples = budget*(step + 1)/iterSteps - total;
+            startPass(samples);
+            popcorn->wait();
+            total += samples;
+            handleEvents();
+        }
+        if (!running) break;
+        if (img) prepareFrame(rows, 1);
+        else popcorn->clear();
+        char title[512];
+        snprintf(title, sizeof(title), "Poster %ix%i    Band %i of %i    %.2f sec",
+                 posterWidth, posterHeight, band + 1, bands, (SDL_GetTicks() - startTime)/1000.0);
+        setTitle(title);
+    }
+    if (img) fclose(img);
+    popcorn->setScreen();
 }
-#endif
 
-/**************************************************************************************/
-
-void calc(int samples, float *buffer) {
-    for (int total = 0; total < samples; total++) {
-        popcornIterate(buffer);
-    }
+void startPass(long samples) {
+    popcorn->params = params;
+    popcorn->start(samples);
 }
 
-void popcornIterate(float *buffer) {
-#ifdef  USE_SSE2
-    __m128 x = _mm_set_ps(rand()%1000000000, rand()%1000000,
-                          rand()%1000000000, rand()%1000000);
-    __m128 y = _mm_set_ps(rand()%1000000000, rand()%1000000,
-                          rand()%1000000000, rand()%1000000);
-    x = _mm_mul_ps(x, rstartScale); y = _mm_mul_ps(y, rstartScale);
-    x = _mm_sub_ps(x, _mm_set1_ps(1)); y = _mm_sub_ps(y, _mm_set1_ps(1));
-    x = _mm_mul_ps(x, _mm_set1_ps(internwidth));
-    y = _mm_mul_ps(y, _mm_set1_ps(internheight));
-    __m128 dx, dy;
-    for (int i = 0; i < iterMax; i++) {
-        dx = f(x, y); dy = g(x, y);
-        x = _mm_add_ps(x, dx);
-        y = _mm_add_ps(y, dy);
-        insert(buffer, x, y);
+// Trace a pass of samples orbits. A pass on a time budget is cut short at
+// deadline and feeds the schedule its rate. Returns the orbits traced.
+long runPass(long samples, double deadline) {
+    double begin = now();
+    startPass(samples);
+    if (!schedule.active()) {
+        popcorn->wait();
+        return samples;
     }
-#else
-    float x = (rand()%1000000)/1000000.0; x *= 2; x -= 1; x *= internwidth;
-    float y = (rand()%1000000)/1000000.0; y *= 2; y -= 1; y *= internheight;
-    float dx, dy;
-    for (int i = 0; i < iterMax; i++) {
-        dx = f(x, y); dy = g(x, y);
-        x += dx; y += dy;
-        insert(buffer, x, y);
+    while (!popcorn->waitFor(5)) {
+        if (now() >= deadline) popcorn->cancel();
     }
-#endif
+    // Workers stop at a batch boundary, so the count claimed is close enough
+    long traced = popcorn->traced(samples);
+    if (running) popcorn->resume();
+    schedule.measurePass(traced, now() - begin);
+    return traced;
 }
 
-#ifdef  USE_SSE2
-void insert(float *buffer, __m128 x, __m128 y) {
-    x = _mm_add_ps(x, internXoff); y = _mm_add_ps(y, internYoff);
-    x = _mm_mul_ps(x, wmul); y = _mm_mul_ps(y, hmul);
-    __m128 x0 = _mm_floor_positive_ps(x), y0 = _mm_floor_positive_ps(y);
-    __m128 xfac = _mm_sub_ps(x, x0), yfac = _mm_sub_ps(x, y0);
-    float x0f[4], y0f[4], xfacf[4], yfacf[4];
-    _mm_store_ps(x0f, x0); _mm_store_ps(y0f, y0);
-    _mm_store_ps(xfacf, xfac); _mm_store_ps(yfacf, yfac);
-    for (int i = 0; i < 4; i++) {
-        int x0i = x0f[i], x1i = x0i+1;
-        int y0i = y0f[i], y1i = y0i+1;
-        float ixfac = 1-xfacf[i];
-        float iyfac = 1-yfacf[i];
-        buffer[XY(x0i, y0i)] += ixfac * iyfac;
-        buffer[XY(x1i, y0i)] += xfacf[i] * iyfac;
-        buffer[XY(x0i, y1i)] += ixfac * yfacf[i];
-        buffer[XY(x1i, y1i)] += xfacf[i] * yfacf[i];
-    }
-#else
-void insert(float *buffer, float x, float y) {
-    x += internwidth; x *= .5; x += offsetx; x /= internwidth; x *= width;
-    y += internheight; y *= .5; y += offsety; y /= internheight; y *= height;
-    int x1 = ceil(x), x0 = x1 - 1;
-    int y1 = ceil(y), y0 = y1 - 1;
-    float xfac = x - x0, yfac = y - y0;
-    float ixfac = 1-xfac, iyfac = 1-yfac;
-    if (y0 >= 0 && x0 >= 0 && y1 < height && x1 < width) {
-        buffer[XY(x0, y0)] += ixfac * iyfac;
-        buffer[XY(x1, y0)] += xfac * iyfac;
-        buffer[XY(x0, y1)] += ixfac * yfac;
-        buffer[XY(x1, y1)] += xfac * yfac;
-    }
-#endif
+// SDL_GetTicks() counts whole milliseconds, too coarse to time a probe
+double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void preparePixels() {
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            float preval = 0;
-            for (int i = 0; i < buffers.size(); i++) {
-                preval += buffers[i][XY(x, y)];
-            }
-            pixels[XY(x, y)] = std::min(sqrt(preval)*intensifyScreen, 255.0);
-        }
-    }
+// The preview is pre-faulted in the same row bands the reductions later
+// write, so the first frame doesn't pay for page faults
+void allocateImages() {
+    pixels = (Uint32 *) allocHuge(popcornWidth*popcornHeight*sizeof(Uint32));
+    if (pixels == NULL) quit(1);
+    popcorn->firstTouch(pixels, popcornWidth*sizeof(Uint32));
 }
 
-void prepareFrame() {
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            float val = 0;
-            for (int i = 0; i < buffers.size(); i++) {
-                val += buffers[i][XY(x, y)];
-            }
-            float col = sqrt(val)/dampenFrame;
-            float* pixel = frame[XY(x, y)];
-            pixel[0] = col; pixel[1] = col; pixel[2] = col;
-        }
-    }
+// Density grows with the orbit count and the tone maps take its square root,
+// so a running total of samples orbits is brightened by this much to look
+// like a whole frame of frameIters
+float toneScale(long samples) {
+    return samples > 0 ? sqrtf((float) frameIters / samples) : 1;
+}
+
+// The tuned intensity stays as it is; only this preview is scaled
+void preparePixels(float scale) {
+    popcorn->params = params;
+    popcorn->params.intensifyScreen *= scale;
+    popcorn->preview(pixels);
+}
+
+// A frame on a time budget traces however many orbits fit, so it is
+// brightened by scale (see toneScale()) to the density of frameIters and
+// doesn't flicker with the orbit count
+void prepareFrame(RowSink &rows, float scale) {
+    popcorn->params = params;
+    popcorn->params.dampenFrame /= scale;
+    popcorn->resolve(rows);
 }
 
-void updateCoefs() {
-    t0 += s0 * dt;
-    t1 += s1 * dt;
-    t2 += s2 * dt;
-    t3 += s3 * dt;
-    offsety += dty * dt;
-#ifdef  USE_SSE2
-    t0_vec = _mm_set1_ps(t0); t1_vec = _mm_set1_ps(t1);
-    t2_vec = _mm_set1_ps(t2); t3_vec = _mm_set1_ps(t3);
-#endif
+// Expose the current frame from the smoothed scale, moving the screen
+// preview's brightness by the same factor
+void applyExposure() {
+    float dampenFrame = exposure.dampenFrame();
+    params.intensifyScreen *= params.dampenFrame / dampenFrame;
+    params.dampenFrame = dampenFrame;
 }
 
 void drawScreen() {
-    SDL_UpdateTexture(texture, NULL, pixels, width * sizeof(Uint32));
+    SDL_UpdateTexture(texture, NULL, pixels, popcornWidth * sizeof(Uint32));
     SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 }
 
+// Tone map the running total to the window and the shared-memory ring,
+// skipping the reduction entirely when neither is there to show it
+void showPreview(int frameNum, long samples) {
+    if (!window && !previewName) return;
+    preparePixels(toneScale(samples));
+    if (window) drawScreen();
+    if (previewName) previewPublish(preview, pixels, frameNum, samples);
+}
+
+// Progress goes in the window title, or to stdout when headless
+void setTitle(const char *title) {
+    if (window) SDL_SetWindowTitle(window, title);
+    else puts(title);
+}
+
 void handleEvents() {
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
-        switch (event.type) {
-            case SDL_QUIT:
+        handleEvent(event);
+    }
+}
+
+void handleEvent(const SDL_Event &event) {
+    switch (event.type) {
+        case SDL_QUIT:
+            running = false;
+            popcorn->cancel();
+            break;
+        case SDL_KEYDOWN: {
+            SDL_Keycode key = event.key.keysym.sym;
+            if (key == SDLK_ESCAPE) {
                 running = false;
-                break;
-            case SDL_KEYDOWN:
-                if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    running = false;
-                }
-                break;
+                popcorn->cancel();
+            }
+            if (!interactive) break;
+            float step = (event.key.keysym.mod & KMOD_SHIFT) ? fineTuneStep : tuneStep;
+            for (int i = 0; i < tunableCount; i++) {
+                if (key == tuneInc[i]) tune(i, step);
+                if (key == tuneDec[i]) tune(i, -step);
+            }
+            if (key == SDLK_EQUALS || key == SDLK_PLUS) {
+                params.intensifyScreen *= intensifyStep;
+                retoned = true;
+            }
+            if (key == SDLK_MINUS) {
+                params.intensifyScreen /= intensifyStep;
+                retoned = true;
+            }
+            break;
         }
+        case SDL_MOUSEMOTION:
+            // Dragging pans the view
+            if (interactive && (event.motion.state & SDL_BUTTON_LMASK)) {
+                int winW, winH;
+                SDL_GetWindowSize(window, &winW, &winH);
+                tune(4, event.motion.xrel * popcornFieldWidth / winW);
+                tune(5, event.motion.yrel * popcornFieldHeight / winH);
+            }
+            break;
+        case SDL_MOUSEWHEEL:
+            if (interactive && event.wheel.y != 0) {
+                params.intensifyScreen *= event.wheel.y > 0 ? intensifyStep : 1/intensifyStep;
+                retoned = true;
+            }
+            break;
     }
 }
 
-void clearData() {
-    memset(frame, 0, width*height*3*sizeof(float));
-    memset(pixels, 0, width*height*sizeof(Uint32));
-    for (int i = 0; i < buffers.size(); i++) {
-        memset(buffers[i], 0, width*height*sizeof(float));
+// Queue an edit and cancel the pass in flight; interactiveLoop() applies it
+// once the workers have stopped
+void tune(int which, float amount) {
+    tuneEdits[which] += amount;
+    tuned = true;
+    popcorn->cancel();
+}
+
+void printTunables() {
+    printf("t0 = %g, t1 = %g, t2 = %g, t3 = %g, offsetx = %g, offsety = %g, intensifyScreen = %g\n",
+           params.t0, params.t1, params.t2, params.t3, params.offsetx, params.offsety, params.intensifyScreen);
+}
+
+// Explore the coefficients live. Every edit cancels the pass in flight and
+// restarts from a tiny pass, and each later pass doubles in size, so a rough
+// preview shows up almost at once and sharpens while left alone.
+void interactiveLoop() {
+    long total = 0, pass = previewIters;
+    bool redraw = false;
+    printTunables();
+    while (running) {
+        if (total < frameIters) {
+            long samples = std::min(pass, frameIters - total);
+            popcorn->resume();
+            startPass(samples);
+            while (!popcorn->waitFor(5)) handleEvents();
+            if (!popcorn->cancelled()) {
+                total += samples;
+                pass *= 2;
+                redraw = true;
+            }
+        } else {
+            // Fully refined, sleep until something happens
+            SDL_Event event;
+            if (SDL_WaitEventTimeout(&event, 100)) handleEvent(event);
+            handleEvents();
+        }
+        if (tuned) {
+            for (int i = 0; i < tunableCount; i++) {
+                *tunables[i] += tuneEdits[i];
+                tuneEdits[i] = 0;
+            }
+            tuned = false;
+            printTunables();
+            popcorn->clear();
+            total = 0;
+            pass = previewIters;
+            continue;
+        }
+        if (redraw || retoned) {
+            showPreview(0, total);
+            char title[512];
+            sprintf(title, "Interactive    %li samples    t0 %.3f  t1 %.3f  t2 %.3f  t3 %.3f  offset %.3f, %.3f  intensity %.2f",
+                    total, params.t0, params.t1, params.t2, params.t3, params.offsetx, params.offsety, params.intensifyScreen);
+            SDL_SetWindowTitle(window, title);
+            if (retoned) printTunables();
+            redraw = retoned = false;
+        }
     }
 }
 
@@ -328,6 +660,8 @@ void quit(int rc) {
     if (rc != 0) {
         fprintf(stderr, "ERROR!\n");
     }
+    if (previewName) previewClose(preview);
+    delete popcorn;
     SDL_Quit();
     exit(rc);
 }
\ No newline at end of file
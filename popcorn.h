@@ -0,0 +1,52 @@
+#ifndef POPCORN_H
+#define POPCORN_H
+
+// libpopcorn's public types and limits (see renderer.h). Everything a tool
+// embedding the renderer sees is here and prefixed; the renderer's own state
+// and the kernels' shorthand live in renderstate.h.
+
+#include <stdint.h>
+
+// The screen: the default view, and the size of the preview
+const int popcornWidth = 1920, popcornHeight = popcornWidth*.5625;
+// Half the width and height of the field the screen shows, in field units
+const float popcornFieldWidth = 2, popcornFieldHeight = 1.125;
+// Orbits a worker claims at a time from a pass's shared counter, so a pass
+// needs several times this per thread to keep every worker busy
+const int popcornChunkOrbits = 4096;
+// The finest field grid (see Renderer::gridSamples), which keeps every
+// sample index exact in a float
+const int popcornMaxGridSamples = 1024;
+
+// What the kernels splat into and resolve: normally the screen, or in poster
+// mode one full-width band of the poster, rows top to top + rows of an
+// image width x imageHeight. Buffer rows are stride floats apart.
+struct View {
+    int width, rows, stride;
+    int top, imageHeight;
+    float wmul, hmul;       // world units to image pixels
+};
+
+// The coefficients of the field (see field.h), the view offset and the
+// tone-mapping scales of the screen preview and the saved frame
+struct Params {
+    float t0, t1, t2, t3;
+    float offsetx, offsety;
+    float intensifyScreen, dampenFrame;
+};
+
+// Reductions count the tone-mapped value of every lit pixel, sqrt(density)
+// before scaling, from 2^popcornHistogramLow up, in four bins per octave
+// split by the top two mantissa bits. Bin b covers 2^(popcornHistogramLow +
+// b/4) times [1 + (b%4)/4, 1 + (b%4 + 1)/4), b/4 rounding down; values past
+// either end go in the end bins.
+const int popcornHistogramBins = 256, popcornHistogramLow = -32;
+
+struct Histogram {
+    uint64_t count[popcornHistogramBins];
+    uint64_t total;
+    // The value below which fraction of the counted pixels fall
+    float percentile(float fraction) const;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#include "preview.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char previewMagic[8] = "POPVIEW";
+
+static PreviewSlot *slotAt(PreviewHeader *h, uint64_t i) {
+    return (PreviewSlot *) ((char *) (h + 1) + (i % h->slots) * h->slotBytes);
+}
+
+static uint32_t *slotPixels(PreviewSlot *slot) {
+    return (uint32_t *) (slot + 1);
+}
+
+bool previewCreate(PreviewRing &ring, const char *name, int width, int height) {
+    size_t slotBytes = (sizeof(PreviewSlot) + (size_t) width * height * sizeof(uint32_t) + 63) / 64 * 64;
+    ring.bytes = sizeof(PreviewHeader) + previewSlots * slotBytes;
+    ring.owner = true;
+    snprintf(ring.name, sizeof(ring.name), "%s", name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, ring.bytes) != 0) {
+        perror(name);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, ring.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(name);
+        shm_unlink(name);
+        return false;
+    }
+    // A fresh object reads as zeros: every seq even, nothing published yet.
+    // The magic goes in last so viewers never attach to a half-made header.
+    PreviewHeader *h = ring.header = (PreviewHeader *) map;
+    h->width = width;
+    h->height = height;
+    h->slots = previewSlots;
+    h->slotBytes = slotBytes;
+    h->latest.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(h->magic, previewMagic, sizeof(h->magic));
+    return true;
+}
+
+void previewPublish(PreviewRing &ring, const uint32_t *pixels, int frame, long samples) {
+    PreviewHeader *h = ring.header;
+    uint64_t publish = h->latest.load(std::memory_order_relaxed);
+    PreviewSlot *slot = slotAt(h, publish);
+    uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->frame = frame;
+    slot->samples = samples;
+    slot->publish = publish + 1;
+    memcpy(slotPixels(slot), pixels, (size_t) h->width * h->height * sizeof(uint32_t));
+    slot->seq.store(seq + 2, std::memory_order_release);
+    h->latest.store(publish + 1, std::memory_order_release);
+}
+
+void previewClose(PreviewRing &ring) {
+    if (ring.header == NULL) return;
+    munmap(ring.header, ring.bytes);
+    if (ring.owner) shm_unlink(ring.name);
+    ring.header = NULL;
+}
+
+bool previewAttach(PreviewRing &ring, const char *name) {
+    ring.header = NULL;
+    ring.owner = false;
+    snprintf(ring.name, sizeof(ring.name), "%s", name);
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < sizeof(PreviewHeader)) {
+        perror(name);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(name);
+        return false;
+    }
+    PreviewHeader *h = (PreviewHeader *) map;
+    ring.bytes = st.st_size;
+    if (memcmp(h->magic, previewMagic, sizeof(h->magic)) != 0
+        || sizeof(PreviewHeader) + (size_t) h->slots * h->slotBytes > ring.bytes) {
+        fprintf(stderr, "%s: not a preview ring\n", name);
+        munmap(map, ring.bytes);
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    ring.header = h;
+    return true;
+}
+
+bool previewRead(PreviewRing &ring, uint32_t *pixels, int &frame, long &samples) {
+    PreviewHeader *h = ring.header;
+    for (int attempt = 0; attempt < 16; attempt++) {
+        uint64_t latest = h->latest.load(std::memory_order_acquire);
+        if (latest == 0) return false;
+        PreviewSlot *slot = slotAt(h, latest - 1);
+        uint32_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq & 1) continue;
+        frame = slot->frame;
+        samples = slot->samples;
+        memcpy(pixels, slotPixels(slot), (size_t) h->width * h->height * sizeof(uint32_t));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) == seq) return true;
+    }
+    return false;
+}
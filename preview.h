@@ -0,0 +1,50 @@
+#ifndef POPCORN_PREVIEW_H
+#define POPCORN_PREVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// The tone-mapped preview, published into a POSIX shared-memory object for
+// viewers in other processes. The object holds a PreviewHeader followed by
+// previewSlots slots, each a PreviewSlot and then width*height ARGB pixels.
+// The renderer fills the slot after the newest one and then advances
+// latest, so a reader copying the newest slot is almost never overtaken.
+// Each slot is guarded by a seqlock: seq is odd while the slot is being
+// written, and a reader whose copy began and ended on the same even seq
+// has a consistent image.
+
+const int previewSlots = 3;
+
+struct PreviewHeader {
+    char magic[8];                  // "POPVIEW"
+    uint32_t width, height, slots;
+    uint32_t slotBytes;             // PreviewSlot plus pixels, 64-byte multiple
+    std::atomic<uint64_t> latest;   // publish count; newest slot is (latest - 1) % slots
+};
+
+struct PreviewSlot {
+    std::atomic<uint32_t> seq;
+    int32_t frame;                  // frame number being rendered
+    int64_t samples;                // orbits in the image so far
+    uint64_t publish;               // publish count this image went out as
+};
+
+struct PreviewRing {
+    PreviewHeader *header;
+    size_t bytes;
+    bool owner;
+    char name[256];
+};
+
+// Renderer side. Returns false after reporting on stderr.
+bool previewCreate(PreviewRing &ring, const char *name, int width, int height);
+void previewPublish(PreviewRing &ring, const uint32_t *pixels, int frame, long samples);
+void previewClose(PreviewRing &ring);
+
+// Viewer side. previewRead() copies the newest image into pixels (width*height
+// ARGB) and returns false if there is none yet or the writer kept overtaking.
+bool previewAttach(PreviewRing &ring, const char *name);
+bool previewRead(PreviewRing &ring, uint32_t *pixels, int &frame, long &samples);
+
+#endif
@@ -0,0 +1,391 @@
+#include "renderer.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "alloc.h"
+#include "renderstate.h"
+// Only for the field's periods
+#include "field.h"
+
+const Params defaultParams = {-2, 1, 3, -4, 0, .57, 4, 512};
+// Distance below zero in x and y the field grid covers: fresh orbits start
+// within internwidth and move at most one unit a step, continued orbits are
+// re-seeded once off the view
+static const float gridReach = 16;
+// Rows each worker resolves per block of a streamed frame
+static const int blockRowsPerWorker = 8;
+
+Renderer::Renderer(WorkerPool *pool, const Kernels *kernels)
+    : params(defaultParams), continueOrbits(false), reseedRate(0), gridSamples(0), sweepCount(0),
+      s(new RenderState), sequenceFrames(0), pool(pool), kernels(kernels) {
+    for (int c = 0; c < 4; c++) sweepStep[c] = 0;
+    s->params = params;
+    s->continueOrbits = false;
+    s->reseedRate = 0;
+    s->cancel = false;
+    s->nextOrbit = 0;
+    s->pool = pool;
+    s->pixels = NULL;
+    s->grid.active = false;
+    s->grid.nx = s->grid.ny = 0;
+    s->grid.maxError = s->grid.rmsError = 0;
+    s->sweep.count = 0;
+    memset(&lastHistogram, 0, sizeof(lastHistogram));
+    restartSequence();
+    setScreen();
+}
+
+// Each worker's buffer is allocated and first touched by that worker, so its
+// pages land on the worker's NUMA node. Multi-node machines also get one
+// partial-sum buffer per node, first touched by a worker on that node.
+Renderer *Renderer::create(const CpuTopology &topo, const Kernels *kernels) {
+    Renderer *r = new Renderer(new WorkerPool(topo), kernels);
+    RenderState *s = r->s;
+    WorkerPool *pool = r->pool;
+    s->buffers.assign(pool->size(), NULL);
+    s->workerHistograms.assign((size_t) pool->size() * histogramBins, 0);
+    s->workerOrbits.resize(pool->size());
+    for (int i = 0; i < pool->size(); i++) {
+        s->workerOrbits[i].next = 0;
+        s->workerOrbits[i].rng = 0x9e3779b9u * (i + 1);
+    }
+    if (pool->nodeCount() > 1) s->nodeBuffers.assign(pool->nodeCount(), NULL);
+    pool->run([&](int worker) {
+        s->buffers[worker] = (float *) allocHuge(bufferSize*sizeof(float));
+        if (s->buffers[worker]) memset(s->buffers[worker], 0, bufferSize*sizeof(float));
+        if (!s->nodeBuffers.empty() && pool->rankInNode(worker) == 0) {
+            int node = pool->nodeOf(worker);
+            s->nodeBuffers[node] = (float *) allocHuge(bufferSize*sizeof(float));
+            if (s->nodeBuffers[node]) memset(s->nodeBuffers[node], 0, bufferSize*sizeof(float));
+        }
+    });
+    bool ok = true;
+    for (int i = 0; i < s->buffers.size(); i++) ok = ok && s->buffers[i];
+    for (int i = 0; i < s->nodeBuffers.size(); i++) ok = ok && s->nodeBuffers[i];
+    if (!ok) {
+        fprintf(stderr, "Couldn't allocate the accumulation buffers\n");
+        delete r;
+        return NULL;
+    }
+    return r;
+}
+
+Renderer::~Renderer() {
+    delete pool;
+    for (int i = 0; i < s->buffers.size(); i++) {
+        if (s->buffers[i]) freeHuge(s->buffers[i], bufferSize*sizeof(float));
+    }
+    for (int i = 0; i < s->nodeBuffers.size(); i++) {
+        if (s->nodeBuffers[i]) freeHuge(s->nodeBuffers[i], bufferSize*sizeof(float));
+    }
+    delete s;
+}
+
+void Renderer::renderFrame(long samples, float *rgb) {
+    trace(samples);
+    resolve(rgb);
+}
+
+void Renderer::trace(long samples) {
+    start(samples);
+    wait();
+}
+
+void Renderer::start(long samples) {
+    s->params = params;
+    s->continueOrbits = continueOrbits;
+    s->reseedRate = reseedRate;
+    s->nextOrbit = 0;
+    s->sequence.base += passSamples;
+    passSamples = samples;
+    s->grid.active = gridSamples > 0;
+    if (s->grid.active) updateGrid();
+    updateSweep();
+    pool->start([=](int worker) {
+        kernels->calc(*s, samples, worker);
+    });
+}
+
+void Renderer::wait() {
+    pool->wait();
+}
+
+bool Renderer::waitFor(int milliseconds) {
+    return pool->waitFor(milliseconds);
+}
+
+static int powerOfTwoAtLeast(float n) {
+    int p = 1;
+    while (p < n) p *= 2;
+    return p;
+}
+
+// Resample the field grid when its size or the coefficients have changed
+// since it was built, then measure how far its steps are from exact. The
+// offsets move the view, not the field, so they don't count.
+void Renderer::updateGrid() {
+    FieldGrid &grid = s->grid;
+    int nx = powerOfTwoAtLeast(std::min(gridSamples, maxGridSamples));
+    int ny = powerOfTwoAtLeast(nx * fieldPeriodY / fieldPeriodX);
+    const Params &p = s->params, &b = grid.builtFor;
+    if (nx == grid.nx && ny == grid.ny && p.t0 == b.t0 && p.t1 == b.t1 && p.t2 == b.t2 && p.t3 == b.t3) return;
+    grid.nx = nx;
+    grid.ny = ny;
+    grid.scaleX = nx / fieldPeriodX;
+    grid.scaleY = ny / fieldPeriodY;
+    // Far enough for any orbit that can still reach the view. Whole
+    // periods, and no more, so the lookup keeps its fraction bits.
+    grid.shiftX = ceilf(gridReach / fieldPeriodX) * fieldPeriodX;
+    grid.shiftY = ceilf(gridReach / fieldPeriodY) * fieldPeriodY;
+    grid.samples.resize(2 * (size_t) (nx + 1) * (ny + 1));
+    grid.builtFor = p;
+    pool->run([=](int worker) {
+        kernels->buildField(*s, worker);
+    });
+    std::vector<float> maxErrors(pool->size());
+    std::vector<double> sumSquares(pool->size());
+    pool->run([&](int worker) {
+        kernels->fieldError(*s, worker, maxErrors[worker], sumSquares[worker]);
+    });
+    grid.maxError = *std::max_element(maxErrors.begin(), maxErrors.end());
+    double sum = 0;
+    for (int i = 0; i < pool->size(); i++) sum += sumSquares[i];
+    grid.rmsError = sqrt(sum / fieldErrorPoints);
+}
+
+// Lay out the sweep's tiles and fill its lane tables from params, long
+// enough for the widest block of lanes to start at any variant
+void Renderer::updateSweep() {
+    Sweep &sweep = s->sweep;
+    sweep.count = sweepCount;
+    if (sweepCount == 0) return;
+    sweep.columns = ceilf(sqrtf(sweepCount));
+    sweep.rows = (sweepCount + sweep.columns - 1) / sweep.columns;
+    const View &view = s->view;
+    int pitchX = view.width / sweep.columns, pitchY = view.rows / sweep.rows;
+    sweep.tileWidth = pitchX - 1;
+    sweep.tileHeight = pitchY - 1;
+    sweep.scaleX = sweep.tileWidth / (2*internwidth);
+    sweep.scaleY = sweep.tileHeight / (2*internheight);
+    std::vector<float> *tables[4] = {&sweep.t0, &sweep.t1, &sweep.t2, &sweep.t3};
+    int length = sweepCount + 16 * orbitBlock;
+    for (int c = 0; c < 4; c++) tables[c]->resize(length);
+    sweep.originX.resize(length);
+    sweep.originY.resize(length);
+    for (int i = 0; i < length; i++) {
+        int v = i % sweepCount;
+        for (int c = 0; c < 4; c++) (*tables[c])[i] = variantCoefficient(v, c);
+        sweep.originX[i] = v % sweep.columns * pitchX;
+        sweep.originY[i] = v / sweep.columns * pitchY;
+    }
+}
+
+float Renderer::variantCoefficient(int variant, int c) const {
+    return (&params.t0)[c] + (variant - (sweepCount - 1) / 2.0f) * sweepStep[c];
+}
+
+void Renderer::gridError(float &maxPixels, float &rmsPixels) const {
+    maxPixels = s->grid.maxError * s->view.wmul;
+    rmsPixels = s->grid.rmsError * s->view.wmul;
+}
+
+void Renderer::cancel() {
+    s->cancel = true;
+}
+
+bool Renderer::cancelled() const {
+    return s->cancel;
+}
+
+void Renderer::resume() {
+    s->cancel = false;
+}
+
+long Renderer::traced(long samples) const {
+    return std::min(s->nextOrbit.load(), samples);
+}
+
+// Rows of the view handed to one of parts workers
+void Renderer::rowBand(int part, int parts, int &y0, int &y1) const {
+    y0 = (long)s->view.rows * part / parts;
+    y1 = (long)s->view.rows * (part + 1) / parts;
+}
+
+// Sum the buffers of each NUMA node into that node's partial-sum buffer,
+// reading only memory local to the node. The final reduction then crosses
+// the interconnect once per node rather than once per thread. With consume
+// set, each thread buffer row is zeroed right after it is read.
+void Renderer::foldNodeBuffers(bool consume) {
+    if (s->nodeBuffers.empty()) return;
+    pool->run([=](int worker) {
+        int node = pool->nodeOf(worker);
+        int y0, y1;
+        rowBand(pool->rankInNode(worker), pool->workersInNode(node), y0, y1);
+        for (int y = y0; y < y1; y++) kernels->foldRow(*s, node, y, consume);
+    });
+}
+
+bool Renderer::preview(uint32_t *pixels) {
+    const View &view = s->view;
+    if (view.width != width || view.rows != height || view.top != 0 || view.imageHeight != height) return false;
+    s->params = params;
+    s->pixels = pixels;
+    foldNodeBuffers(false);
+    clearHistograms();
+    pool->run([=](int worker) {
+        int y0, y1;
+        rowBand(worker, pool->size(), y0, y1);
+        std::vector<float> row(s->view.width);
+        uint32_t *histogram = workerHistogram(worker);
+        for (int y = y0; y < y1; y++) {
+            kernels->sumRow(*s, y, &row[0], false);
+            kernels->toneScreen(*s, y, &row[0], histogram);
+        }
+    });
+    mergeHistograms();
+    return true;
+}
+
+// Copies streamed rows into a whole image
+class ImageRows : public RowSink {
+public:
+    ImageRows(float *rgb) : rgb(rgb), width(0) {}
+    void begin(int width, int blockRows) { this->width = width; }
+    void row(int y, const float *in) { memcpy(rgb + (size_t) y * width * 3, in, width * 3 * sizeof(float)); }
+private:
+    float *rgb;
+    int width;
+};
+
+void Renderer::resolve(float *rgb) {
+    ImageRows rows(rgb);
+    resolve(rows);
+}
+
+// Resolve the finished frame, clearing the accumulation buffers as it goes
+// so the next frame starts from zero without a separate pass over memory.
+// Each block of rows is summed, tone mapped and handed to the sink while
+// it is still in cache, so nothing the size of the frame is written. The
+// row under the view takes splats but is never resolved, and in a banded
+// render may be a data row of the next band, so it is cleared too.
+void Renderer::resolve(RowSink &sink) {
+    s->params = params;
+    foldNodeBuffers(true);
+    clearHistograms();
+    const int rows = s->view.rows;
+    const int blockRows = std::min(blockRowsPerWorker * pool->size(), rows);
+    sink.begin(s->view.width, blockRows);
+    for (int top = 0; top < rows; top += blockRows) {
+        int block = std::min(blockRows, rows - top);
+        pool->run([&](int worker) {
+            int y0 = top + block * worker / pool->size();
+            int y1 = top + block * (worker + 1) / pool->size();
+            std::vector<float> row(s->view.width), rgb(s->view.width * 3);
+            uint32_t *histogram = workerHistogram(worker);
+            for (int y = y0; y < y1; y++) {
+                kernels->sumRow(*s, y, &row[0], true);
+                kernels->toneFrame(*s, &row[0], &rgb[0], histogram);
+                sink.row(y, &rgb[0]);
+            }
+        });
+        sink.flush(top + block);
+    }
+    pool->run([=](int worker) {
+        const View &view = s->view;
+        kernels->zeroFloats(s->buffers[worker] + BXY(0, view.rows), view.stride);
+    });
+    mergeHistograms();
+    restartSequence();
+}
+
+// splitmix64's finalizer, to turn a frame count into a rotation
+static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Start the next frame's orbits from the top of the sequence under a fresh
+// rotation, so each frame's points are as even as the first's but none are
+// reused. The rotation depends only on the frame count, so a run renders
+// the same frames at any thread count.
+void Renderer::restartSequence() {
+    sequenceFrames++;
+    s->sequence.base = 0;
+    s->sequence.rotateX = mix(sequenceFrames * 2);
+    s->sequence.rotateY = mix(sequenceFrames * 2 + 1);
+    passSamples = 0;
+}
+
+void Renderer::clearHistograms() {
+    std::fill(s->workerHistograms.begin(), s->workerHistograms.end(), 0);
+}
+
+uint32_t *Renderer::workerHistogram(int worker) {
+    return &s->workerHistograms[(size_t) worker * histogramBins];
+}
+
+void Renderer::mergeHistograms() {
+    memset(&lastHistogram, 0, sizeof(lastHistogram));
+    for (int worker = 0; worker < pool->size(); worker++) {
+        const uint32_t *counts = &s->workerHistograms[(size_t) worker * histogramBins];
+        for (int b = 0; b < histogramBins; b++) lastHistogram.count[b] += counts[b];
+    }
+    for (int b = 0; b < histogramBins; b++) lastHistogram.total += lastHistogram.count[b];
+}
+
+// Interpolated linearly inside the bin the fraction falls in, as the bins
+// are linear within their octave
+float Histogram::percentile(float fraction) const {
+    if (total == 0) return 0;
+    double want = fraction * (double) total, below = 0;
+    int b = 0;
+    while (b < histogramBins - 1 && below + count[b] < want) below += count[b++];
+    double within = count[b] ? (want - below) / count[b] : 0;
+    return ldexp(1 + (b % 4 + std::min(within, 1.0)) / 4, histogramLow + b / 4);
+}
+
+// Every pixel of an image is rewritten by each reduction, so only the
+// accumulation buffers need clearing, each by its owner in parallel
+void Renderer::clear() {
+    pool->run([=](int worker) {
+        kernels->zeroFloats(s->buffers[worker], bufferSize);
+    });
+    restartSequence();
+}
+
+int Renderer::threads() const {
+    return pool->size();
+}
+
+const View &Renderer::view() const {
+    return s->view;
+}
+
+// A view of rows rows takes (imageWidth + guardBand) * (rows + 1) floats
+int Renderer::maxViewRows(int imageWidth) {
+    if (imageWidth <= 0) return 0;
+    return std::max(bufferSize / ((long) imageWidth + guardBand) - 1, 0L);
+}
+
+bool Renderer::setView(int imageWidth, int imageHeight, int top, int rows) {
+    if (rows <= 0 || rows > maxViewRows(imageWidth)) return false;
+    View &view = s->view;
+    view.width = imageWidth;
+    view.rows = rows;
+    view.stride = imageWidth + guardBand;
+    view.top = top;
+    view.imageHeight = imageHeight;
+    view.wmul = imageWidth/(2*internwidth);
+    view.hmul = imageHeight/(2*internheight);
+    return true;
+}
+
+void Renderer::firstTouch(void *image, size_t rowBytes) {
+    pool->run([=](int worker) {
+        int y0, y1;
+        rowBand(worker, pool->size(), y0, y1);
+        memset((char *) image + y0 * rowBytes, 0, (y1 - y0) * rowBytes);
+    });
+}
@@ -0,0 +1,129 @@
+#ifndef POPCORN_RENDERER_H
+#define POPCORN_RENDERER_H
+
+#include <stdint.h>
+#include "kernels.h"
+#include "popcorn.h"
+#include "rowsink.h"
+#include "topology.h"
+
+class WorkerPool;
+struct RenderState;
+
+// The original animation's coefficients at its first frame, and its tone
+// mapping
+extern const Params defaultParams;
+
+// libpopcorn's renderer. Each one owns its parameters, its worker pool and
+// its accumulation buffers and keeps no state anywhere else, so a process
+// can run several side by side and keep them warm from one job to the next.
+// Images go into caller memory.
+//
+// Orbits accumulate into a running total until resolve() turns it into a
+// frame and empties it. Apart from cancel(), a renderer is driven from one
+// thread at a time.
+class Renderer {
+public:
+    // A renderer on the CPUs of topo using the given kernel table (see
+    // selectKernels()), or NULL after reporting on stderr
+    static Renderer *create(const CpuTopology &topo, const Kernels *kernels);
+    ~Renderer();
+
+    // Read when a pass starts or an image is made, defaultParams at first
+    Params params;
+    // Orbit continuation: keep each worker's orbits alive across passes and
+    // frames, re-seeding with probability reseedRate each time one has taken
+    // as many steps as a fresh orbit
+    bool continueOrbits;
+    float reseedRate;
+    // Field grid mode: step orbits by bilinear lookups in f and g sampled
+    // at least gridSamples times across a period in x (rounded up to a
+    // power of two, at most popcornMaxGridSamples, and as finely in y)
+    // instead of evaluating them. The grid is rebuilt when a pass starts
+    // with new coefficients. 0 is off.
+    int gridSamples;
+    // Sweep mode: render sweepCount variants of t0..t3 side by side as a
+    // contact sheet, in tiles left to right and top to bottom over the
+    // screen. Each lane of a batch traces its own variant, so one pass makes
+    // them all, each with its share of the orbits. Variant i has
+    // coefficient c at params + (i - (sweepCount - 1)/2) * sweepStep[c].
+    // 0 is off; fresh orbits in the screen view only, without the grid.
+    int sweepCount;
+    float sweepStep[4];
+    float variantCoefficient(int variant, int c) const;
+
+    int threads() const;
+    const Kernels *kernelTable() const { return kernels; }
+    const View &view() const;
+
+    // Render a whole frame of samples orbits into popcornWidth*popcornHeight
+    // RGB floats
+    void renderFrame(long samples, float *rgb);
+
+    // Add a pass of exactly samples orbits to the running total. Workers
+    // claim small chunks from a shared counter, so fast workers keep taking
+    // work until the budget is spent instead of idling at the end of a fixed
+    // share. start() returns at once; finish with wait() or waitFor(), which
+    // returns whether the pass finished within the timeout.
+    void trace(long samples);
+    void start(long samples);
+    void wait();
+    bool waitFor(int milliseconds);
+    // Cut the pass in flight short; safe from any thread. Stays set, so
+    // later passes return at once too, until resume().
+    void cancel();
+    bool cancelled() const;
+    void resume();
+    // Orbits the last pass traced, counted by the chunks claimed
+    long traced(long samples) const;
+    // How far a grid step lands from the exact one, in pixels of the view:
+    // the largest and rms over a sample of points. 0 before a grid.
+    void gridError(float &maxPixels, float &rmsPixels) const;
+
+    // Tone map the running total into popcornWidth*popcornHeight ARGB
+    // pixels. Only the screen has a preview: after setView() it returns
+    // false, pixels untouched.
+    bool preview(uint32_t *pixels);
+    // Tone map the running total and empty it for the next frame, streaming
+    // its view().rows rows of view().width RGB floats through sink (see
+    // rowsink.h), or into one image
+    void resolve(RowSink &sink);
+    void resolve(float *rgb);
+    void clear();
+    // The pixels of the last preview() or resolve(), counted on the way
+    const Histogram &histogram() const { return lastHistogram; }
+
+    // Accumulate rows top to top + rows of an imageWidth x imageHeight image
+    // instead of the screen, so a large image can be rendered band by band.
+    // At most maxViewRows(imageWidth) rows fit the accumulation buffers;
+    // none when the image is too wide. setScreen() goes back to the screen.
+    bool setView(int imageWidth, int imageHeight, int top, int rows);
+    void setScreen() { setView(popcornWidth, popcornHeight, 0, popcornHeight); }
+    static int maxViewRows(int imageWidth);
+
+    // Zero an image of view rows in the bands the reductions write, so its
+    // pages are first touched by the workers that later fill them
+    void firstTouch(void *image, size_t rowBytes);
+
+private:
+    Renderer(WorkerPool *pool, const Kernels *kernels);
+    void foldNodeBuffers(bool consume);
+    void rowBand(int part, int parts, int &y0, int &y1) const;
+    void updateGrid();
+    void updateSweep();
+    void restartSequence();
+    void clearHistograms();
+    uint32_t *workerHistogram(int worker);
+    void mergeHistograms();
+
+    RenderState *s;
+    Histogram lastHistogram;
+    // The last pass's orbits, which the next pass's start points follow,
+    // and the frames begun, which pick the rotation (see restartSequence())
+    long passSamples;
+    uint64_t sequenceFrames;
+    WorkerPool *pool;
+    const Kernels *kernels;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef POPCORN_RENDERSTATE_H
+#define POPCORN_RENDERSTATE_H
+
+// Renderer state shared between renderer.cpp and the kernels in kernel.cpp,
+// which is compiled once per instruction set. Private to libpopcorn: nothing
+// outside those two includes it. Nothing here is global: each Renderer owns
+// one RenderState and hands it to every kernel call.
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "pool.h"
+#include "popcorn.h"
+
+const int width = popcornWidth, height = popcornHeight;
+// Accumulation buffers carry a guard band of padding columns and one padding
+// row, so a splat whose top-left corner is on screen never needs its other
+// three corners checked. The padding is never read back.
+const int guardBand = 16, stride = width + guardBand;
+const long bufferSize = (long) stride * (height + 1);
+const float internwidth = popcornFieldWidth, internheight = popcornFieldHeight;
+const int iterMax = 10;
+const int chunkOrbits = popcornChunkOrbits;
+// Independent SIMD batches each kernel call advances side by side
+const int orbitBlock = 4;
+// Points the field grid's step error is measured at
+const int fieldErrorPoints = 1 << 16;
+const int maxGridSamples = popcornMaxGridSamples;
+// Orbit continuation: orbits each worker keeps alive across passes and
+// frames, a multiple of every block of batches
+const int liveOrbits = 1024;
+const int histogramBins = popcornHistogramBins, histogramLow = popcornHistogramLow;
+
+// Field grid mode: f and g sampled at nx by ny points over one period cell
+// (see field.h), stored as (f, g) pairs in rows of nx + 1 so the last column
+// and row repeat the first and a bilinear lookup never wraps mid-cell. A
+// lookup shifts its point by whole periods to make it non-negative, then
+// wraps; points further than that into the negative read zero velocity.
+// nx and ny are powers of two so the wrap is exact in float.
+struct FieldGrid {
+    bool active;
+    int nx, ny;
+    float scaleX, scaleY;       // samples per unit
+    float shiftX, shiftY;
+    std::vector<float> samples;
+    Params builtFor;
+    // Step error against f and g over a sample of points, in field units
+    float maxError, rmsError;
+};
+
+// Sweep mode: count variants of t0..t3, variant v splatting into tile v of
+// a contact sheet laid over the screen, left to right and top to bottom.
+// Tiles are a pitch apart and a pixel smaller, so a splat's far corners
+// fall in the gap. The lane tables repeat the variants cyclically, so the
+// lanes of a batch of orbits first to first + n - 1 load their variants
+// (first + i) % count from index first % count.
+struct Sweep {
+    int count;                  // 0 when off
+    int columns, rows;
+    int tileWidth, tileHeight;
+    float scaleX, scaleY;       // world units to tile pixels
+    std::vector<float> t0, t1, t2, t3, originX, originY;
+};
+
+// Fresh orbits start at points of a scrambled R2 sequence (see startPoints()
+// in kernel.cpp): orbit i of a pass at point base + i. Each pass carries on
+// where the last one stopped, and each frame starts over under a new
+// rotation, so the start points of a frame are spread evenly however many
+// passes make it and whichever workers claim which chunks.
+struct StartSequence {
+    uint64_t base;
+    uint64_t rotateX, rotateY;
+};
+
+#define XY(i, j)    ((i) + (j)*width)
+#define BXY(i, j)   ((i) + (long)(j)*view.stride)
+#define PI  3.141592654f
+
+// A worker's continued orbits, stepped one batch at a time in a ring, and
+// its own random state so re-seeding shares nothing with other workers
+struct LiveOrbits {
+    std::vector<float> x, y;
+    int next;
+    uint32_t rng;
+};
+
+struct RenderState {
+    View view;
+    Params params;
+    bool continueOrbits;
+    float reseedRate;
+    std::atomic<bool> cancel;
+    std::atomic<long> nextOrbit;
+    StartSequence sequence;
+
+    WorkerPool *pool;
+    std::vector<float*> buffers;
+    std::vector<float*> nodeBuffers;
+    std::vector<LiveOrbits> workerOrbits;
+    FieldGrid grid;
+    Sweep sweep;
+    // Where the preview reduction writes: the caller's width*height ARGB
+    // pixels. Reductions count into histogramBins counts per worker.
+    uint32_t *pixels;
+    std::vector<uint32_t> workerHistograms;
+};
+
+#endif
@@ -7,6 +7,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* This file contains code to read and write four byte rgbe file format
  developed by Greg Ward.  It handles the conversions between rgbe and
@@ -18,6 +23,9 @@
  feel free to modify it to suit your needs.
 
  (Place notice here if you modified the code.)
+ Modified for Popcorn: added RGBE_ReadHeaderMem and RGBE_ReadPixelsMem
+ for bulk decoding of files held in memory, and RGBE_EncodeScanline for
+ encoding into memory.
  posted to http://www.graphics.cornell.edu/~bjw/
  written by Bruce Walter  (bjw@graphics.cornell.edu)  5/26/95
  based on code written by Greg Ward
@@ -226,11 +234,13 @@ int RGBE_ReadPixels(FILE *fp, float *data, int numpixels)
 /* save some space.  For each scanline, each channel (r,g,b,e) is */
 /* encoded separately for better compression. */
 
-static int RGBE_WriteBytes_RLE(FILE *fp, unsigned char *data, int numbytes)
+/* encode numbytes bytes of one channel at out, returning the end.  the */
+/* runs chosen are the original file writer's, so output is unchanged */
+static unsigned char *RGBE_EncodeBytes_RLE(const unsigned char *data,
+					    int numbytes, unsigned char *out)
 {
 #define MINRUNLENGTH 4
   int cur, beg_run, run_count, old_run_count, nonrun_count;
-  unsigned char buf[2];
 
   cur = 0;
   while(cur < numbytes) {
@@ -241,16 +251,14 @@ static int RGBE_WriteBytes_RLE(FILE *fp, unsigned char *data, int numbytes)
       beg_run += run_count;
       old_run_count = run_count;
       run_count = 1;
-      while((data[beg_run] == data[beg_run + run_count]) 
-	    && (beg_run + run_count < numbytes) && (run_count < 127))
+      while((beg_run + run_count < numbytes) && (run_count < 127)
+	    && (data[beg_run] == data[beg_run + run_count]))
 	run_count++;
     }
     /* if data before next big run is a short run then write it as such */
     if ((old_run_count > 1)&&(old_run_count == beg_run - cur)) {
-      buf[0] = 128 + old_run_count;   /*write short run*/
-      buf[1] = data[cur];
-      if (fwrite(buf,sizeof(buf[0])*2,1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL);
+      *out++ = 128 + old_run_count;   /*write short run*/
+      *out++ = data[cur];
       cur = beg_run;
     }
     /* write out bytes until we reach the start of the next run */
@@ -258,67 +266,81 @@ static int RGBE_WriteBytes_RLE(FILE *fp, unsigned char *data, int numbytes)
       nonrun_count = beg_run - cur;
       if (nonrun_count > 128) 
 	nonrun_count = 128;
-      buf[0] = nonrun_count;
-      if (fwrite(buf,sizeof(buf[0]),1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL);
-      if (fwrite(&data[cur],sizeof(data[0])*nonrun_count,1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL);
+      *out++ = nonrun_count;
+      memcpy(out,&data[cur],nonrun_count);
+      out += nonrun_count;
       cur += nonrun_count;
     }
     /* write out next run if one was found */
     if (run_count >= MINRUNLENGTH) {
-      buf[0] = 128 + run_count;
-      buf[1] = data[beg_run];
-      if (fwrite(buf,sizeof(buf[0])*2,1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL);
+      *out++ = 128 + run_count;
+      *out++ = data[beg_run];
       cur += run_count;
     }
   }
-  return RGBE_RETURN_SUCCESS;
+  return out;
 #undef MINRUNLENGTH
 }
 
+size_t RGBE_ScanlineBytesMax(int scanline_width)
+{
+  size_t w = scanline_width;
+
+  if ((scanline_width < 8)||(scanline_width > 0x7fff))
+    return 4*w;
+  return 4 + 4*(w + (w + 127)/128);
+}
+
+size_t RGBE_EncodeScanline(const float *data, int scanline_width,
+			   unsigned char *scratch, unsigned char *out)
+{
+  unsigned char *p = out;
+  int i;
+
+  if ((scanline_width < 8)||(scanline_width > 0x7fff)) {
+    /* run length encoding is not allowed so write flat*/
+    for(i=0;i<scanline_width;i++) {
+      float2rgbe(p,data[RGBE_DATA_RED],
+		 data[RGBE_DATA_GREEN],data[RGBE_DATA_BLUE]);
+      data += RGBE_DATA_SIZE;
+      p += 4;
+    }
+    return p - out;
+  }
+  *p++ = 2;
+  *p++ = 2;
+  *p++ = scanline_width >> 8;
+  *p++ = scanline_width & 0xFF;
+  RGBE_PackPlanes(data,scratch,scanline_width,scanline_width);
+  /* each of the four channels separately run length encoded */
+  /* first red, then green, then blue, then exponent */
+  for(i=0;i<4;i++)
+    p = RGBE_EncodeBytes_RLE(&scratch[i*scanline_width],scanline_width,p);
+  return p - out;
+}
+
 int RGBE_WritePixels_RLE(FILE *fp, float *data, int scanline_width,
 			 int num_scanlines)
 {
-  unsigned char rgbe[4];
   unsigned char *buffer;
-  int i, err;
+  size_t line_bytes, bytes;
 
   if ((scanline_width < 8)||(scanline_width > 0x7fff))
     /* run length encoding is not allowed so write flat*/
     return RGBE_WritePixels(fp,data,scanline_width*num_scanlines);
-  buffer = (unsigned char *)malloc(sizeof(unsigned char)*4*scanline_width);
+  line_bytes = RGBE_ScanlineBytesMax(scanline_width);
+  buffer = (unsigned char *)malloc(4*scanline_width + line_bytes);
   if (buffer == NULL) 
     /* no buffer space so write flat */
     return RGBE_WritePixels(fp,data,scanline_width*num_scanlines);
   while(num_scanlines-- > 0) {
-    rgbe[0] = 2;
-    rgbe[1] = 2;
-    rgbe[2] = scanline_width >> 8;
-    rgbe[3] = scanline_width & 0xFF;
-    if (fwrite(rgbe, sizeof(rgbe), 1, fp) < 1) {
+    bytes = RGBE_EncodeScanline(data,scanline_width,buffer,
+				buffer + 4*scanline_width);
+    if (fwrite(buffer + 4*scanline_width, bytes, 1, fp) < 1) {
       free(buffer);
       return rgbe_error(rgbe_write_error,NULL);
     }
-    for(i=0;i<scanline_width;i++) {
-      float2rgbe(rgbe,data[RGBE_DATA_RED],
-		 data[RGBE_DATA_GREEN],data[RGBE_DATA_BLUE]);
-      buffer[i] = rgbe[0];
-      buffer[i+scanline_width] = rgbe[1];
-      buffer[i+2*scanline_width] = rgbe[2];
-      buffer[i+3*scanline_width] = rgbe[3];
-      data += RGBE_DATA_SIZE;
-    }
-    /* write out each of the four channels separately run length encoded */
-    /* first red, then green, then blue, then exponent */
-    for(i=0;i<4;i++) {
-      if ((err = RGBE_WriteBytes_RLE(fp,&buffer[i*scanline_width],
-				     scanline_width)) != RGBE_RETURN_SUCCESS) {
-	free(buffer);
-	return err;
-      }
-    }
+    data += RGBE_DATA_SIZE*scanline_width;
   }
   free(buffer);
   return RGBE_RETURN_SUCCESS;
@@ -410,3 +432,308 @@ int RGBE_ReadPixels_RLE(FILE *fp, float *data, int scanline_width,
   free(scanline_buffer);
   return RGBE_RETURN_SUCCESS;
 }
+
+/* The code below decodes a whole file held in memory.  A serial pass */
+/* walks the run length codes once to validate them and record where */
+/* each scanline starts, so the scanlines can then be decoded in */
+/* parallel without any further bounds worries. */
+
+int RGBE_ReadHeaderMem(const unsigned char *buf, size_t size, int *width,
+		       int *height, rgbe_header_info *info,
+		       size_t *header_size)
+{
+  FILE *fp;
+  long pos;
+  int err;
+
+  /* the header is a few short lines, so reuse the stdio parser on it */
+  fp = fmemopen((void *)buf,size,"rb");
+  if (fp == NULL)
+    return rgbe_error(rgbe_read_error,NULL);
+  err = RGBE_ReadHeader(fp,width,height,info);
+  pos = ftell(fp);
+  fclose(fp);
+  if (err != RGBE_RETURN_SUCCESS)
+    return err;
+  if ((*width <= 0)||(*height <= 0))
+    return rgbe_error(rgbe_format_error,"bad image size");
+  *header_size = pos;
+  return RGBE_RETURN_SUCCESS;
+}
+
+typedef struct {
+  const unsigned char *buf;
+  const size_t *offsets;  /* start of each scanline within buf */
+  float *data;
+  int scanline_width;
+  int flat_from;          /* scanlines from here on are stored flat */
+  int first, last;        /* this thread's scanlines */
+} rgbe_decode_job;
+
+/* check one run length encoded scanline and return the offset just past */
+/* it, or 0 if it is corrupt */
+static size_t RGBE_SkipScanline_RLE(const unsigned char *buf, size_t size,
+				    size_t pos, int scanline_width)
+{
+  int i, left, count;
+
+  pos += 4;
+  for(i=0;i<4;i++) {
+    left = scanline_width;
+    while(left > 0) {
+      if (pos + 2 > size)
+	return 0;
+      if (buf[pos] > 128) {
+	count = buf[pos]-128;
+	pos += 2;
+      }
+      else {
+	count = buf[pos];
+	pos += 1 + count;
+      }
+      if ((count == 0)||(count > left)||(pos > size))
+	return 0;
+      left -= count;
+    }
+  }
+  return pos;
+}
+
+/* 4 pixels of separated r,g,b,e bytes to interleaved floats. */
+/* the scale 2^(e-136) is built exactly from exponent bits.  it can */
+/* be denormal and 2^(e-127) can overflow, so it is made as a product */
+/* of two normal halves 2^(floor(e/2)-68) * 2^(ceil(e/2)-68) */
+static INLINE void rgbe2float4(float *data, const unsigned char *r,
+			       const unsigned char *g, const unsigned char *b,
+			       const unsigned char *e)
+{
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  __m128i ei, ri, gi, bi, lo, hi, black;
+  __m128 scale, red, green, blue, t0, t1, t2, t3;
+  int word;
+
+#define RGBE_LOAD4(dst,src) \
+  memcpy(&word,src,4); \
+  dst = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(word),zero),zero)
+  RGBE_LOAD4(ri,r); RGBE_LOAD4(gi,g); RGBE_LOAD4(bi,b); RGBE_LOAD4(ei,e);
+#undef RGBE_LOAD4
+  /* black pixels (e == 0) would make a denormal scale, which is slow */
+  /* even when masked afterwards, so they are scaled by 1 and then zeroed */
+  black = _mm_cmpeq_epi32(ei,zero);
+  ei = _mm_or_si128(ei,_mm_and_si128(black,_mm_set1_epi32(136)));
+  lo = _mm_srli_epi32(ei,1);
+  hi = _mm_sub_epi32(ei,lo);
+  scale = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(lo,_mm_set1_epi32(59)),23)),
+		     _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(hi,_mm_set1_epi32(59)),23)));
+  scale = _mm_andnot_ps(_mm_castsi128_ps(black),scale);
+  red = _mm_mul_ps(_mm_cvtepi32_ps(ri),scale);
+  green = _mm_mul_ps(_mm_cvtepi32_ps(gi),scale);
+  blue = _mm_mul_ps(_mm_cvtepi32_ps(bi),scale);
+  /* transpose to r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3 */
+  t0 = _mm_unpacklo_ps(red,green);
+  t1 = _mm_unpackhi_ps(red,green);
+  _mm_storeu_ps(data,_mm_shuffle_ps(t0,_mm_shuffle_ps(blue,red,_MM_SHUFFLE(1,1,0,0)),
+				    _MM_SHUFFLE(2,0,1,0)));
+  _mm_storeu_ps(data+4,_mm_shuffle_ps(_mm_shuffle_ps(green,blue,_MM_SHUFFLE(1,1,1,1)),t1,
+				      _MM_SHUFFLE(1,0,2,0)));
+  t2 = _mm_shuffle_ps(blue,red,_MM_SHUFFLE(3,3,2,2));
+  t3 = _mm_shuffle_ps(green,blue,_MM_SHUFFLE(3,3,3,3));
+  _mm_storeu_ps(data+8,_mm_shuffle_ps(t2,t3,_MM_SHUFFLE(2,0,2,0)));
+#else
+  unsigned char rgbe[4];
+  int i;
+
+  for(i=0;i<4;i++) {
+    rgbe[0] = r[i]; rgbe[1] = g[i]; rgbe[2] = b[i]; rgbe[3] = e[i];
+    rgbe2float(&data[RGBE_DATA_RED],&data[RGBE_DATA_GREEN],
+	       &data[RGBE_DATA_BLUE],rgbe);
+    data += RGBE_DATA_SIZE;
+  }
+#endif
+}
+
+static void *RGBE_DecodeScanlines(void *arg)
+{
+  rgbe_decode_job *job = (rgbe_decode_job *)arg;
+  int w = job->scanline_width;
+  unsigned char *line, *ptr, *ptr_end;
+  const unsigned char *src;
+  float *data;
+  int y, i, count;
+
+  line = (unsigned char *)malloc(4*w + 4);
+  if (line == NULL)
+    return (void *)1;
+  for(y=job->first;y<job->last;y++) {
+    src = job->buf + job->offsets[y];
+    data = job->data + (size_t)y*w*RGBE_DATA_SIZE;
+    if (y >= job->flat_from) {
+      /* flat pixels: split the channels so the same converter applies */
+      for(i=0;i<w;i++) {
+	line[i] = src[4*i];
+	line[i+w] = src[4*i+1];
+	line[i+2*w] = src[4*i+2];
+	line[i+3*w] = src[4*i+3];
+      }
+    }
+    else {
+      src += 4;
+      ptr = line;
+      for(i=0;i<4;i++) {
+	ptr_end = &line[(i+1)*w];
+	while(ptr < ptr_end) {
+	  if (*src > 128) {
+	    count = *src++ - 128;
+	    memset(ptr,*src++,count);
+	  }
+	  else {
+	    count = *src++;
+	    memcpy(ptr,src,count);
+	    src += count;
+	  }
+	  ptr += count;
+	}
+      }
+    }
+    for(i=0;i+4<=w;i+=4)
+      rgbe2float4(&data[i*RGBE_DATA_SIZE],&line[i],&line[i+w],
+		  &line[i+2*w],&line[i+3*w]);
+    for(;i<w;i++) {
+      unsigned char rgbe[4];
+      rgbe[0] = line[i]; rgbe[1] = line[i+w];
+      rgbe[2] = line[i+2*w]; rgbe[3] = line[i+3*w];
+      rgbe2float(&data[i*RGBE_DATA_SIZE+RGBE_DATA_RED],
+		 &data[i*RGBE_DATA_SIZE+RGBE_DATA_GREEN],
+		 &data[i*RGBE_DATA_SIZE+RGBE_DATA_BLUE],rgbe);
+    }
+  }
+  free(line);
+  return NULL;
+}
+
+int RGBE_ReadPixelsMem(const unsigned char *buf, size_t size, float *data,
+		       int scanline_width, int num_scanlines, int num_threads)
+{
+  size_t *offsets, pos, flat_bytes;
+  rgbe_decode_job *jobs;
+  pthread_t *threads;
+  int y, t, flat_from, failed;
+
+  if ((scanline_width <= 0)||(num_scanlines <= 0))
+    return rgbe_error(rgbe_format_error,"bad image size");
+  offsets = (size_t *)malloc(sizeof(size_t)*num_scanlines);
+  if (offsets == NULL)
+    return rgbe_error(rgbe_memory_error,"unable to allocate buffer space");
+  /* index and validate: same rules as RGBE_ReadPixels_RLE, including */
+  /* falling back to flat pixels at the first scanline without a marker */
+  pos = 0;
+  flat_from = num_scanlines;
+  for(y=0;y<num_scanlines;y++) {
+    offsets[y] = pos;
+    if ((scanline_width < 8)||(scanline_width > 0x7fff)||(pos + 4 > size)
+	||(buf[pos] != 2)||(buf[pos+1] != 2)||(buf[pos+2] & 0x80)) {
+      flat_from = y;
+      break;
+    }
+    if ((((int)buf[pos+2])<<8 | buf[pos+3]) != scanline_width) {
+      free(offsets);
+      return rgbe_error(rgbe_format_error,"wrong scanline width");
+    }
+    pos = RGBE_SkipScanline_RLE(buf,size,pos,scanline_width);
+    if (pos == 0) {
+      free(offsets);
+      return rgbe_error(rgbe_format_error,"bad scanline data");
+    }
+  }
+  if (flat_from < num_scanlines) {
+    flat_bytes = (size_t)4*scanline_width*(num_scanlines - flat_from);
+    if (pos + flat_bytes > size) {
+      free(offsets);
+      return rgbe_error(rgbe_format_error,"truncated pixel data");
+    }
+    for(y=flat_from;y<num_scanlines;y++)
+      offsets[y] = pos + (size_t)4*scanline_width*(y - flat_from);
+  }
+
+  if (num_threads <= 0)
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads > num_scanlines)
+    num_threads = num_scanlines;
+  if (num_threads < 1)
+    num_threads = 1;
+  jobs = (rgbe_decode_job *)malloc(sizeof(rgbe_decode_job)*num_threads);
+  threads = (pthread_t *)malloc(sizeof(pthread_t)*num_threads);
+  if ((jobs == NULL)||(threads == NULL)) {
+    free(offsets); free(jobs); free(threads);
+    return rgbe_error(rgbe_memory_error,"unable to allocate buffer space");
+  }
+  for(t=0;t<num_threads;t++) {
+    jobs[t].buf = buf;
+    jobs[t].offsets = offsets;
+    jobs[t].data = data;
+    jobs[t].scanline_width = scanline_width;
+    jobs[t].flat_from = flat_from;
+    jobs[t].first = (long)num_scanlines*t/num_threads;
+    jobs[t].last = (long)num_scanlines*(t+1)/num_threads;
+  }
+  /* the calling thread takes the first share itself */
+  failed = 0;
+  for(t=1;t<num_threads;t++)
+    if (pthread_create(&threads[t],NULL,RGBE_DecodeScanlines,&jobs[t]) != 0) {
+      /* couldn't start a thread: decode its share here instead */
+      failed |= RGBE_DecodeScanlines(&jobs[t]) != NULL;
+      threads[t] = pthread_self();
+    }
+  failed |= RGBE_DecodeScanlines(&jobs[0]) != NULL;
+  for(t=1;t<num_threads;t++) {
+    void *result;
+    if (pthread_equal(threads[t],pthread_self()))
+      continue;
+    pthread_join(threads[t],&result);
+    failed |= result != NULL;
+  }
+  free(offsets); free(jobs); free(threads);
+  if (failed)
+    return rgbe_error(rgbe_memory_error,"unable to allocate buffer space");
+  return RGBE_RETURN_SUCCESS;
+}
+
+/* float pixels to planar rgbe: numpixels red bytes, then green, blue */
+/* and exponent, each plane plane_size bytes after the last.  the bytes */
+/* are exactly the ones the RLE writer would store for these pixels */
+void RGBE_PackPlanes(const float *data, unsigned char *planes,
+		     size_t plane_size, int numpixels)
+{
+  unsigned char rgbe[4];
+  int i;
+
+  for(i=0;i<numpixels;i++) {
+    float2rgbe(rgbe,data[RGBE_DATA_RED],data[RGBE_DATA_GREEN],
+	       data[RGBE_DATA_BLUE]);
+    planes[i] = rgbe[0];
+    planes[i+plane_size] = rgbe[1];
+    planes[i+2*plane_size] = rgbe[2];
+    planes[i+3*plane_size] = rgbe[3];
+    data += RGBE_DATA_SIZE;
+  }
+}
+
+/* planar rgbe back to float pixels, with the bulk decoder's converter */
+void RGBE_UnpackPlanes(const unsigned char *planes, size_t plane_size,
+		       float *data, int numpixels)
+{
+  unsigned char rgbe[4];
+  int i;
+
+  for(i=0;i+4<=numpixels;i+=4)
+    rgbe2float4(&data[i*RGBE_DATA_SIZE],&planes[i],&planes[i+plane_size],
+		&planes[i+2*plane_size],&planes[i+3*plane_size]);
+  for(;i<numpixels;i++) {
+    rgbe[0] = planes[i]; rgbe[1] = planes[i+plane_size];
+    rgbe[2] = planes[i+2*plane_size]; rgbe[3] = planes[i+3*plane_size];
+    rgbe2float(&data[i*RGBE_DATA_SIZE+RGBE_DATA_RED],
+	       &data[i*RGBE_DATA_SIZE+RGBE_DATA_GREEN],
+	       &data[i*RGBE_DATA_SIZE+RGBE_DATA_BLUE],rgbe);
+  }
+}
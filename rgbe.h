@@ -47,6 +47,36 @@ int RGBE_WritePixels_RLE(FILE *fp, float *data, int scanline_width,
 int RGBE_ReadPixels_RLE(FILE *fp, float *data, int scanline_width,
 			int num_scanlines);
 
+/* encoding one scanline into memory, for writers that stream rows. */
+/* RGBE_EncodeScanline stores exactly the bytes RGBE_WritePixels_RLE */
+/* writes for the scanline at out, which must hold */
+/* RGBE_ScanlineBytesMax(scanline_width) bytes, and returns their */
+/* count.  scratch must hold 4*scanline_width bytes. */
+size_t RGBE_ScanlineBytesMax(int scanline_width);
+size_t RGBE_EncodeScanline(const float *data, int scanline_width,
+			   unsigned char *scratch, unsigned char *out);
+
+/* bulk decoding of a whole file already in memory (e.g. mmap'd) */
+/* RGBE_ReadHeaderMem also returns the header length; the pixel data */
+/* starts that many bytes into buf.  RGBE_ReadPixelsMem validates the */
+/* entire pixel stream first, then decodes scanlines on num_threads */
+/* threads (0 for one per online cpu) into data, which must hold */
+/* scanline_width*num_scanlines*3 floats.  Results are identical to */
+/* RGBE_ReadPixels_RLE. */
+int RGBE_ReadHeaderMem(const unsigned char *buf, size_t size, int *width,
+		       int *height, rgbe_header_info *info,
+		       size_t *header_size);
+int RGBE_ReadPixelsMem(const unsigned char *buf, size_t size, float *data,
+		       int scanline_width, int num_scanlines, int num_threads);
+
+/* conversion between float pixels and planar rgbe bytes, for codecs */
+/* working on the bytes directly.  planes holds the red, green, blue and */
+/* exponent bytes of numpixels pixels, each plane plane_size bytes apart */
+void RGBE_PackPlanes(const float *data, unsigned char *planes,
+		     size_t plane_size, int numpixels);
+void RGBE_UnpackPlanes(const unsigned char *planes, size_t plane_size,
+		       float *data, int numpixels);
+
 #endif /* _H_RGBE */
 
 
@@ -0,0 +1,24 @@
+#include "rowsink.h"
+extern "C" {
+    #include "rgbe.h"
+};
+
+void HdrRows::begin(int width, int blockRows) {
+    this->width = width;
+    first = 0;
+    slotBytes = 4 * (size_t) width + RGBE_ScanlineBytesMax(width);
+    slots.resize(slotBytes * blockRows);
+    sizes.resize(blockRows);
+}
+
+void HdrRows::row(int y, const float *rgb) {
+    unsigned char *slot = &slots[(y - first) * slotBytes];
+    sizes[y - first] = RGBE_EncodeScanline(rgb, width, slot, slot + 4 * width);
+}
+
+void HdrRows::flush(int y) {
+    for (int i = 0; i < y - first && good; i++) {
+        good = fwrite(&slots[i * slotBytes + 4 * width], sizes[i], 1, out) == 1;
+    }
+    first = y;
+}
@@ -0,0 +1,44 @@
+#ifndef POPCORN_ROWSINK_H
+#define POPCORN_ROWSINK_H
+
+#include <stdio.h>
+#include <vector>
+
+// Where Renderer::resolve() streams a frame, a block of rows at a time, so
+// the finished frame never exists as a whole float image. Rows of a block
+// come from the workers in parallel and in any order; flush(y) follows on
+// the resolving thread once every row above y is in.
+class RowSink {
+public:
+    virtual ~RowSink() {}
+    // Before the first row of each resolve: the row width in pixels and the
+    // most rows a block will hold
+    virtual void begin(int width, int blockRows) {}
+    // Row y, width RGB floats, only valid during the call
+    virtual void row(int y, const float *rgb) = 0;
+    virtual void flush(int y) {}
+};
+
+// The RLE scanlines of a .hdr, each encoded by the worker that resolved it
+// into a slot of the block and written to out in order at flush(). Writes
+// start wherever out is, normally just after RGBE_WriteHeader(); ok() turns
+// false once one fails.
+class HdrRows : public RowSink {
+public:
+    explicit HdrRows(FILE *out) : out(out), width(0), first(0), slotBytes(0), good(true) {}
+    void begin(int width, int blockRows);
+    void row(int y, const float *rgb);
+    void flush(int y);
+    bool ok() const { return good; }
+
+private:
+    FILE *out;
+    int width, first;
+    size_t slotBytes;
+    // Per slot: planar scratch, then the encoded scanline
+    std::vector<unsigned char> slots;
+    std::vector<size_t> sizes;
+    bool good;
+};
+
+#endif
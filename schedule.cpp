@@ -0,0 +1,47 @@
+#include "schedule.h"
+#include <algorithm>
+
+// Weight of the newest measurement in the smoothed rate and times
+static const double smoothing = .3;
+
+static double smooth(double average, double sample) {
+    return average > 0 ? average + smoothing * (sample - average) : sample;
+}
+
+void Schedule::begin(double now, int frames) {
+    start = now;
+    framesLeft = frames;
+}
+
+double Schedule::renderSeconds(double now) const {
+    double share = perFrame > 0 ? perFrame : 1e30;
+    if (total > 0) {
+        double left = start + total - now;
+        // Stop rather than start a frame that can only finish late
+        if (left <= overhead || framesLeft <= 0) return -1;
+        share = std::min(share, left / framesLeft);
+    }
+    return std::max(share - overhead, 0.0);
+}
+
+long Schedule::samplesFor(double seconds) const {
+    return seconds > 0 ? (long) (rate * seconds) : 0;
+}
+
+void Schedule::measurePass(long samples, double seconds) {
+    // Passes this short are mostly the pool waking up and say little about
+    // the rate; the caller probes again with a longer one
+    if (samples > 0 && seconds > .005) rate = smooth(rate, samples / seconds);
+}
+
+void Schedule::finishFrame(double frameSeconds, double passSeconds) {
+    overhead = smooth(overhead, std::max(frameSeconds - passSeconds, 0.0));
+    frameTime = smooth(frameTime, frameSeconds);
+    framesLeft--;
+}
+
+double Schedule::projectedEnd(double now) const {
+    double each = frameTime;
+    if (total > 0) each = std::min(each, std::max(start + total - now, 0.0) / std::max(framesLeft, 1));
+    return now + each * framesLeft;
+}
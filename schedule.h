@@ -0,0 +1,33 @@
+#ifndef POPCORN_SCHEDULE_H
+#define POPCORN_SCHEDULE_H
+
+// Fits each frame's orbit count to wall-clock time instead of frameIters.
+// Given a deadline for the whole run, a time per frame, or both, it learns
+// the orbit rate from the passes actually rendered and the time each frame
+// spends outside them (reduction, preview, saving), then gives every
+// remaining frame an equal share of what is left. Because each share is
+// recomputed from the clock, early misestimates even out over the run.
+// Times are seconds on one monotonic clock.
+struct Schedule {
+    double total, perFrame;     // budgets, 0 when not set
+    double start;
+    double rate;                // orbits per second, smoothed; 0 until measured
+    double overhead;            // seconds per frame outside the passes, smoothed
+    double frameTime;           // seconds per whole frame, smoothed
+    int framesLeft;
+
+    Schedule() : total(0), perFrame(0), start(0), rate(0), overhead(0), frameTime(0), framesLeft(0) {}
+    bool active() const { return total > 0 || perFrame > 0; }
+    void begin(double now, int frames);
+    // Seconds the next frame may spend tracing orbits, or -1 when the
+    // deadline can't fit another frame
+    double renderSeconds(double now) const;
+    // Orbits that fit in the given seconds at the measured rate
+    long samplesFor(double seconds) const;
+    void measurePass(long samples, double seconds);
+    void finishFrame(double frameSeconds, double passSeconds);
+    // Clock time the run is projected to finish at
+    double projectedEnd(double now) const;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef POPCORN_SIMD_H
+#define POPCORN_SIMD_H
+
+// A thin vector type per SIMD width, so the velocity field and the orbit
+// kernels can be written once as templates over V. V is float for the
+// scalar build, or one of vfloat4 (SSE2), vfloat8 (AVX2 + FMA) and
+// vfloat16 (AVX-512). Each type provides the arithmetic operators plus:
+//
+//   sin, cos            following TRIG_TIER (see fast_math.h)
+//   floorPositive       floor, only valid for non-negative lanes
+//   inRange(v, hi)      bitmask of lanes with 0 <= v < hi, NaN lanes clear
+//   gather(t, i, n)     t[i] per lane for whole-number i, 0 for lanes with
+//                       i outside [0, n) or NaN
+//   storeLanes, storeInts, loadLanes<V>
+//
+// USE_AVX2 and USE_AVX512 pick the wider types and imply USE_SSE2.
+
+#include <math.h>
+
+#if defined(USE_AVX512) || defined(USE_AVX2)
+# ifndef USE_SSE2
+#  define USE_SSE2
+# endif
+#endif
+
+#ifdef  USE_SSE2
+# include <x86intrin.h>
+# include "fast_math.h"
+#endif
+
+template <class V> struct Lanes { static const int count = V::lanes; };
+template <> struct Lanes<float> { static const int count = 1; };
+
+template <class V> inline V loadLanes(const float *p) { return V::load(p); }
+template <> inline float loadLanes<float>(const float *p) { return *p; }
+
+inline void storeLanes(float a, float *p) { *p = a; }
+inline void storeInts(float a, int *p) { *p = (int) a; }
+inline float floorPositive(float a) { return floorf(a); }
+inline unsigned inRange(float a, float hi) { return a >= 0 && a < hi; }
+inline float gather(const float *t, float i, float n) { return inRange(i, n) ? t[(int) i] : 0; }
+
+#ifdef  USE_SSE2
+
+// Run a 4-wide sse_math.h function over each 128-bit quarter of a wider type
+template <class V> inline V perQuad(V x, v4sf (*fn)(v4sf)) {
+    alignas(64) float lane[V::lanes];
+    x.store(lane);
+    for (int i = 0; i < V::lanes; i += 4) _mm_store_ps(lane + i, fn(_mm_load_ps(lane + i)));
+    return V::load(lane);
+}
+
+// The fast_math.h polynomials, written once for the wider types
+template <class V> inline V horner(V z, const float *c, int n) {
+    V p(c[0]);
+    for (int i = 1; i < n; i++) p = fmadd(p, z, V(c[i]));
+    return p;
+}
+
+template <class V> inline V sinWide(V x) {
+#if TRIG_TIER == 0
+    return perQuad(x, sin_ps);
+#else
+    V sign, r = reducePi(x, sign), z = r * r;
+# if TRIG_TIER == 2
+    return flipSign(horner(z, fm_sin5, 3) * r, sign);
+# else
+    return flipSign(horner(z, fm_sin7, 4) * r, sign);
+# endif
+#endif
+}
+
+template <class V> inline V cosWide(V x) {
+#if TRIG_TIER == 0
+    return perQuad(x, cos_ps);
+#else
+    V sign, r = reducePi(x, sign), z = r * r;
+# if TRIG_TIER == 2
+    return flipSign(horner(z, fm_cos6, 4), sign);
+# else
+    return flipSign(horner(z, fm_cos8, 5), sign);
+# endif
+#endif
+}
+
+struct vfloat4 {
+    static const int lanes = 4;
+    __m128 v;
+    vfloat4() {}
+    vfloat4(float a) : v(_mm_set1_ps(a)) {}
+    vfloat4(__m128 a) : v(a) {}
+    static vfloat4 load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+
+    friend vfloat4 operator+(vfloat4 a, vfloat4 b) { return _mm_add_ps(a.v, b.v); }
+    friend vfloat4 operator-(vfloat4 a, vfloat4 b) { return _mm_sub_ps(a.v, b.v); }
+    friend vfloat4 operator*(vfloat4 a, vfloat4 b) { return _mm_mul_ps(a.v, b.v); }
+    friend vfloat4 sin(vfloat4 a) { return sin_tier_ps(a.v); }
+    friend vfloat4 cos(vfloat4 a) { return cos_tier_ps(a.v); }
+    friend vfloat4 floorPositive(vfloat4 a) { return _mm_floor_positive_ps(a.v); }
+    friend unsigned inRange(vfloat4 a, float hi) {
+        __m128 inside = _mm_and_ps(_mm_cmpge_ps(a.v, _mm_setzero_ps()),
+                                   _mm_cmplt_ps(a.v, _mm_set1_ps(hi)));
+        return _mm_movemask_ps(inside);
+    }
+    friend void storeLanes(vfloat4 a, float *p) { a.store(p); }
+    friend void storeInts(vfloat4 a, int *p) { _mm_storeu_si128((__m128i *) p, _mm_cvttps_epi32(a.v)); }
+    // SSE2 has no gather instruction
+    friend vfloat4 gather(const float *t, vfloat4 i, float n) {
+        alignas(16) float lane[4];
+        i.store(lane);
+        for (int k = 0; k < 4; k++) lane[k] = gather(t, lane[k], n);
+        return _mm_load_ps(lane);
+    }
+};
+
+#ifdef  USE_AVX2
+struct vfloat8 {
+    static const int lanes = 8;
+    __m256 v;
+    vfloat8() {}
+    vfloat8(float a) : v(_mm256_set1_ps(a)) {}
+    vfloat8(__m256 a) : v(a) {}
+    static vfloat8 load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    friend vfloat8 operator+(vfloat8 a, vfloat8 b) { return _mm256_add_ps(a.v, b.v); }
+    friend vfloat8 operator-(vfloat8 a, vfloat8 b) { return _mm256_sub_ps(a.v, b.v); }
+    friend vfloat8 operator*(vfloat8 a, vfloat8 b) { return _mm256_mul_ps(a.v, b.v); }
+    friend vfloat8 fmadd(vfloat8 a, vfloat8 b, vfloat8 c) { return _mm256_fmadd_ps(a.v, b.v, c.v); }
+    friend vfloat8 reducePi(vfloat8 x, vfloat8 &sign) {
+        __m256i k = _mm256_cvtps_epi32(_mm256_mul_ps(x.v, _mm256_set1_ps(fm_inv_pi)));
+        vfloat8 kf = _mm256_cvtepi32_ps(k);
+        for (int i = 0; i < 3; i++) x = fmadd(kf, -fm_pi_split[i], x);
+        sign = _mm256_castsi256_ps(_mm256_slli_epi32(k, 31));
+        return x;
+    }
+    friend vfloat8 flipSign(vfloat8 a, vfloat8 sign) { return _mm256_xor_ps(a.v, sign.v); }
+    friend vfloat8 sin(vfloat8 a) { return sinWide(a); }
+    friend vfloat8 cos(vfloat8 a) { return cosWide(a); }
+    friend vfloat8 floorPositive(vfloat8 a) { return _mm256_floor_ps(a.v); }
+    friend unsigned inRange(vfloat8 a, float hi) {
+        __m256 inside = _mm256_and_ps(_mm256_cmp_ps(a.v, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                      _mm256_cmp_ps(a.v, _mm256_set1_ps(hi), _CMP_LT_OQ));
+        return _mm256_movemask_ps(inside);
+    }
+    friend void storeLanes(vfloat8 a, float *p) { a.store(p); }
+    friend void storeInts(vfloat8 a, int *p) { _mm256_storeu_si256((__m256i *) p, _mm256_cvttps_epi32(a.v)); }
+    friend vfloat8 gather(const float *t, vfloat8 i, float n) {
+        __m256 inside = _mm256_and_ps(_mm256_cmp_ps(i.v, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                      _mm256_cmp_ps(i.v, _mm256_set1_ps(n), _CMP_LT_OQ));
+        return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), t, _mm256_cvttps_epi32(i.v), inside, 4);
+    }
+};
+#endif
+
+#ifdef  USE_AVX512
+struct vfloat16 {
+    static const int lanes = 16;
+    __m512 v;
+    vfloat16() {}
+    vfloat16(float a) : v(_mm512_set1_ps(a)) {}
+    vfloat16(__m512 a) : v(a) {}
+    static vfloat16 load(const float *p) { return _mm512_loadu_ps(p); }
+    void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+    friend vfloat16 operator+(vfloat16 a, vfloat16 b) { return _mm512_add_ps(a.v, b.v); }
+    friend vfloat16 operator-(vfloat16 a, vfloat16 b) { return _mm512_sub_ps(a.v, b.v); }
+    friend vfloat16 operator*(vfloat16 a, vfloat16 b) { return _mm512_mul_ps(a.v, b.v); }
+    friend vfloat16 fmadd(vfloat16 a, vfloat16 b, vfloat16 c) { return _mm512_fmadd_ps(a.v, b.v, c.v); }
+    friend vfloat16 reducePi(vfloat16 x, vfloat16 &sign) {
+        __m512i k = _mm512_cvtps_epi32(_mm512_mul_ps(x.v, _mm512_set1_ps(fm_inv_pi)));
+        vfloat16 kf = _mm512_cvtepi32_ps(k);
+        for (int i = 0; i < 3; i++) x = fmadd(kf, -fm_pi_split[i], x);
+        sign = _mm512_castsi512_ps(_mm512_slli_epi32(k, 31));
+        return x;
+    }
+    friend vfloat16 flipSign(vfloat16 a, vfloat16 sign) {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.v), _mm512_castps_si512(sign.v)));
+    }
+    friend vfloat16 sin(vfloat16 a) { return sinWide(a); }
+    friend vfloat16 cos(vfloat16 a) { return cosWide(a); }
+    friend vfloat16 floorPositive(vfloat16 a) {
+        return _mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    }
+    friend unsigned inRange(vfloat16 a, float hi) {
+        return _mm512_cmp_ps_mask(a.v, _mm512_setzero_ps(), _CMP_GE_OQ)
+             & _mm512_cmp_ps_mask(a.v, _mm512_set1_ps(hi), _CMP_LT_OQ);
+    }
+    friend void storeLanes(vfloat16 a, float *p) { a.store(p); }
+    friend void storeInts(vfloat16 a, int *p) { _mm512_storeu_si512(p, _mm512_cvttps_epi32(a.v)); }
+    friend vfloat16 gather(const float *t, vfloat16 i, float n) {
+        return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), inRange(i, n), _mm512_cvttps_epi32(i.v), t, 4);
+    }
+};
+#endif
+
+#endif
+
+#if defined(USE_AVX512)
+typedef vfloat16 Batch;
+#elif defined(USE_AVX2)
+typedef vfloat8 Batch;
+#elif defined(USE_SSE2)
+typedef vfloat4 Batch;
+#else
+typedef float Batch;
+#endif
+
+#endif
@@ -0,0 +1,85 @@
+#include "topology.h"
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+#ifdef  __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+#ifdef  __linux__
+// Parse a sysfs list such as "0-7,16-23"
+static std::vector<int> readCpuList(const char *path) {
+    std::vector<int> cpus;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return cpus;
+    int lo, hi;
+    while (fscanf(file, "%d", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(file);
+        if (c == '-') {
+            if (fscanf(file, "%d", &hi) != 1) break;
+            c = fgetc(file);
+        }
+        for (int cpu = lo; cpu <= hi; cpu++) cpus.push_back(cpu);
+        if (c != ',') break;
+    }
+    fclose(file);
+    return cpus;
+}
+#endif
+
+CpuTopology detectTopology() {
+    CpuTopology topo;
+    topo.nodeCount = 1;
+#ifdef  __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        // Walk the NUMA nodes so each node's CPUs end up next to each other
+        std::vector<int> nodes = readCpuList("/sys/devices/system/node/online");
+        int nodeCount = 0;
+        for (int n = 0; n < nodes.size(); n++) {
+            char path[128];
+            sprintf(path, "/sys/devices/system/node/node%i/cpulist", nodes[n]);
+            std::vector<int> nodeCpus = readCpuList(path);
+            bool used = false;
+            for (int i = 0; i < nodeCpus.size(); i++) {
+                if (!CPU_ISSET(nodeCpus[i], &allowed)) continue;
+                topo.cpus.push_back(nodeCpus[i]);
+                topo.nodeOfCpu.push_back(nodeCount);
+                used = true;
+            }
+            if (used) nodeCount++;
+        }
+        topo.nodeCount = std::max(nodeCount, 1);
+        // No sysfs node information, treat every allowed CPU as one node
+        if (topo.cpus.empty()) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &allowed)) continue;
+                topo.cpus.push_back(cpu);
+                topo.nodeOfCpu.push_back(0);
+            }
+        }
+    }
+#endif
+    if (topo.cpus.empty()) {
+        int count = std::max(std::thread::hardware_concurrency(), 1u);
+        for (int cpu = 0; cpu < count; cpu++) {
+            topo.cpus.push_back(cpu);
+            topo.nodeOfCpu.push_back(0);
+        }
+    }
+    return topo;
+}
+
+bool pinThreadToCpu(int cpu) {
+#ifdef  __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,17 @@
+#ifndef POPCORN_TOPOLOGY_H
+#define POPCORN_TOPOLOGY_H
+
+#include <vector>
+
+// The CPUs this process may run on, grouped so that CPUs sharing a NUMA
+// node are contiguous. Worker i is pinned to cpus[i].
+struct CpuTopology {
+    std::vector<int> cpus;
+    std::vector<int> nodeOfCpu;     // parallel to cpus
+    int nodeCount;
+};
+
+CpuTopology detectTopology();
+bool pinThreadToCpu(int cpu);
+
+#endif